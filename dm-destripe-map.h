@@ -0,0 +1,551 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) driver.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* --------------------------------------------------------------
+ *   Destripe address translation core.
+ *
+ *   Shared by the kernel module (linux-kernel-*) and the userspace
+ *   library & tools (utils/), so keep it free of anything that does
+ *   not exist on both sides (or add a shim below).
+ * -------------------------------------------------------------- */
+
+#ifndef _DM_DESTRIPE_MAP_H
+#define _DM_DESTRIPE_MAP_H
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+
+#define DESTRIPE_MIN_CHUNK	(PAGE_SIZE >> SECTOR_SHIFT)
+
+#define destripe_div64_rem(n, d, rem)	div_u64_rem(n, d, rem)
+
+#else /* userspace */
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uint64_t sector_t;
+
+#define is_power_of_2(n)	((n) != 0 && (((n) & ((n) - 1)) == 0))
+#define __ffs(x)		((unsigned long)__builtin_ctzl(x))
+#define fls(x)			((x) ? 32 - __builtin_clz(x) : 0)
+
+#ifndef likely
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#endif
+
+#define DESTRIPE_MIN_CHUNK	(4096 >> 9)
+
+static inline uint64_t destripe_div64_rem(uint64_t n, uint32_t d, uint32_t *rem)
+{
+	*rem = (uint32_t)(n % d);
+	return n / d;
+}
+
+#endif /* __KERNEL__ */
+
+#define DESTRIPE_MIN_STRIPES	2
+#define DESTRIPE_MAX_STRIPES	64
+
+/* Longest index spec, e.g. "0+1+2+...+63" */
+#define DESTRIPE_IDX_SPEC_MAXLEN	(DESTRIPE_MAX_STRIPES * 3)
+
+/*-----------------------------------------------------------------
+ * Division by an invariant 32-bit divisor without a hardware divide.
+ *
+ * With s = floor(log2(d)) and mult = floor(2^(64+s) / d), the quotient
+ * estimate mulhi64(n, mult) >> s is exact or one short for any 64-bit n,
+ * so a single compare & fixup gives the exact quotient and remainder.
+ * Only used for divisors that are not a power of 2 (those use shifts).
+ *---------------------------------------------------------------*/
+
+struct destripe_recip {
+	uint64_t mult;
+	uint32_t div;
+	int shift;
+};
+
+/* High 64 bits of the 128-bit product a * b */
+static inline uint64_t destripe_mulhi64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__) && !defined(NOT_64_ARCH)
+	return (uint64_t)(((unsigned __int128)a * b) >> 64);
+#else
+	/* 32-bit builds: 4 partial 32x32->64 products, no libgcc helpers */
+	uint64_t al = (uint32_t)a, ah = a >> 32;
+	uint64_t bl = (uint32_t)b, bh = b >> 32;
+	uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+
+	return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/* Slow path setup, divisor must be > 1 and not a power of 2 */
+static inline void destripe_recip_init(struct destripe_recip *r, uint32_t div)
+{
+	uint64_t hi, lo;
+	uint32_t rem;
+
+	r->div = div;
+	r->shift = fls(div) - 1;
+
+	/* long division of 2^(64+shift) by div, in 32-bit digits (2^shift < div) */
+	hi = destripe_div64_rem((uint64_t)1 << (r->shift + 32), div, &rem);
+	lo = destripe_div64_rem((uint64_t)rem << 32, div, &rem);
+	r->mult = (hi << 32) | lo;
+}
+
+static inline uint64_t destripe_recip_divmod(const struct destripe_recip *r, uint64_t n,
+					uint32_t *rem)
+{
+	uint64_t q = destripe_mulhi64(n, r->mult) >> r->shift;
+	uint64_t rr = n - q * r->div;
+
+	if (unlikely(rr >= r->div)) {
+		q++;
+		rr -= r->div;
+	}
+	*rem = (uint32_t)rr;
+	return q;
+}
+
+/*-----------------------------------------------------------------
+ * Stripe index sets: a target exposes one stripe index of the source,
+ * or several of them laid out one of two ways:
+ *
+ *   "i,j,..." interleaved: chunk c of the target is chunk c / nr of
+ *             member c % nr, i.e. the members re-striped with the
+ *             same chunk size.
+ *   "i+j+..." concatenated: the destriped members one after the other.
+ *---------------------------------------------------------------*/
+
+enum destripe_layout {
+	DESTRIPE_LAYOUT_INTERLEAVED = 0,
+	DESTRIPE_LAYOUT_CONCAT,
+};
+
+struct destripe_idx_set {
+	enum destripe_layout layout;
+	uint32_t nr;				/* number of member indices, 1-stripes */
+	uint8_t idx[DESTRIPE_MAX_STRIPES];	/* member stripe indices, in target order */
+};
+
+/*
+ * Parse an index spec ("2", "0,2" or "0+1+2") for a source of destripes
+ * stripes. Returns NULL if OK or an error message (ti->error style).
+ */
+static inline const char *destripe_idx_parse(const char *spec, uint32_t destripes,
+					struct destripe_idx_set *set)
+{
+	uint64_t seen = 0;
+	uint32_t val;
+	char sep = 0;
+
+	set->layout = DESTRIPE_LAYOUT_INTERLEAVED;
+	set->nr = 0;
+
+	for (;;) {
+		if (*spec < '0' || *spec > '9')
+			return "Invalid stripe index (must be 0 - stripes-1)";
+		for (val = 0; *spec >= '0' && *spec <= '9'; spec++) {
+			val = val * 10 + (*spec - '0');
+			if (val >= destripes)
+				return "Invalid stripe index (must be 0 - stripes-1)";
+		}
+		if (seen & (1ULL << val))
+			return "Invalid stripe index list (duplicate index)";
+		seen |= 1ULL << val;
+		set->idx[set->nr++] = (uint8_t)val;
+
+		if (!*spec)
+			break;
+		if ((*spec != ',' && *spec != '+') || (sep && *spec != sep))
+			return "Invalid stripe index list (use i,j,... or i+j+...)";
+		sep = *spec++;
+	}
+
+	if (sep == '+')
+		set->layout = DESTRIPE_LAYOUT_CONCAT;
+	return NULL;
+}
+
+/* Print an index set the way destripe_idx_parse() reads it, returns the length */
+static inline int destripe_idx_print(const struct destripe_idx_set *set, char *buf, int len)
+{
+	const char *sep = set->layout == DESTRIPE_LAYOUT_CONCAT ? "+" : ",";
+	int sz = 0;
+	uint32_t i;
+
+	for (i = 0; i < set->nr && sz < len; i++)
+		sz += snprintf(buf + sz, len - sz, "%s%u", i ? sep : "", set->idx[i]);
+	return sz;
+}
+
+/*-----------------------------------------------------------------
+ * Destripe geometry: which stripe index (or indices) of a striped
+ * source is exposed and how the source is chunked.
+ *---------------------------------------------------------------*/
+
+/*
+ * Map path class, picked once by destripe_geom_init(), so that the per bio
+ * mapping only does the arithmetic its geometry needs.
+ */
+enum destripe_map_class {
+	DESTRIPE_MAP_SHIFT = 0,		/* power of 2 stripes & chunk: shifts/masks only */
+	DESTRIPE_MAP_CHUNK_SHIFT,	/* power of 2 chunk: one multiply by the stripes */
+	DESTRIPE_MAP_GENERIC,		/* any chunk: reciprocal division by the chunk */
+	DESTRIPE_MAP_MULTI,		/* several indices: pick the member, then map */
+};
+
+struct destripe_geom {
+	uint32_t destripes;		/* number of stripes in the source */
+	uint32_t destripe_idx;		/* stripe index exposed by this target (idx.idx[0]) */
+	struct destripe_idx_set idx;	/* all exposed indices & their layout */
+
+	uint32_t chunk_size;		/* in sectors */
+	int chunk_size_shift;		/* log2(chunk_size), -1 if not a power of 2 */
+	int destripes_shift;		/* log2(destripes), -1 if not a power of 2 */
+
+	enum destripe_map_class map_class;
+
+	/* Precomputed for the shift classes */
+	uint64_t chunk_mask;		/* chunk_size - 1 */
+	uint64_t idx_bits;		/* destripe_idx << chunk_size_shift */
+	int row_shift;			/* chunk_size_shift + destripes_shift */
+
+	/* Division-free paths for the non power of 2 cases */
+	struct destripe_recip chunk_recip;
+	struct destripe_recip destripes_recip;
+
+	/* Multi index targets */
+	uint64_t member_len;		/* concatenated: sectors per member */
+	uint32_t concat_step;		/* concatenated: largest power of 2 < idx.nr */
+	int nr_idx_shift;		/* interleaved: log2(idx.nr), -1 if not a power of 2 */
+	struct destripe_recip nr_idx_recip;
+};
+
+/* Validate a geometry, returns NULL if OK or an error message (ti->error style) */
+static inline const char *destripe_geom_check(uint32_t destripes, uint32_t destripe_idx,
+					uint32_t chunk_size)
+{
+	if (destripes < DESTRIPE_MIN_STRIPES || destripes > DESTRIPE_MAX_STRIPES)
+		return "Invalid stripe count (must be 2-64)";
+
+	if (destripe_idx >= destripes)
+		return "Invalid stripe index (must be 0 - stripes-1)";
+
+	/*
+	 * chunk_size is a multiple of the page size (in sectors), so that
+	 * chunk boundaries stay page aligned. Not necessarily a power of 2.
+	 */
+	if (chunk_size < DESTRIPE_MIN_CHUNK || chunk_size % DESTRIPE_MIN_CHUNK)
+		return "Invalid chunk size";
+
+	return NULL;
+}
+
+/*
+ * Validate the target length for an index set, returns NULL if OK or an error
+ * message. Each member gets the same, whole number of chunks.
+ */
+static inline const char *destripe_geom_check_len(const struct destripe_idx_set *set,
+					uint32_t chunk_size, uint64_t len)
+{
+	uint32_t rem;
+
+	len = destripe_div64_rem(len, chunk_size, &rem);
+	if (rem)
+		return "Target length not divisible by chunk size";
+
+	destripe_div64_rem(len, set->nr, &rem);
+	if (rem)
+		return "Target length not divisible by chunk size * number of indices";
+
+	return NULL;
+}
+
+/*
+ * Set up a geometry exposing the indices of *set, checked by destripe_geom_check(),
+ * destripe_idx_parse() & destripe_geom_check_len(). member_len is the destriped length of one member
+ * (target length / set->nr), only used by the concatenated layout.
+ */
+static inline void destripe_geom_init_set(struct destripe_geom *g, uint32_t destripes,
+					const struct destripe_idx_set *set,
+					uint32_t chunk_size, uint64_t member_len)
+{
+	g->destripes = destripes;
+	g->destripe_idx = set->idx[0];
+	g->idx = *set;
+	g->member_len = member_len;
+	g->chunk_size = chunk_size;
+	g->chunk_mask = chunk_size - 1;
+	if (chunk_size & (chunk_size - 1)) {
+		g->chunk_size_shift = -1;
+		destripe_recip_init(&g->chunk_recip, chunk_size);
+	} else
+		g->chunk_size_shift = __ffs(chunk_size);
+	if (destripes & (destripes - 1)) {
+		g->destripes_shift = -1;
+		destripe_recip_init(&g->destripes_recip, destripes);
+	} else
+		g->destripes_shift = __ffs(destripes);
+
+	if (set->nr & (set->nr - 1)) {
+		g->nr_idx_shift = -1;
+		destripe_recip_init(&g->nr_idx_recip, set->nr);
+	} else
+		g->nr_idx_shift = __ffs(set->nr);
+
+	for (g->concat_step = 1; g->concat_step * 2 < set->nr; g->concat_step <<= 1)
+		;
+	if (set->nr == 1)
+		g->concat_step = 0;
+
+	if (set->nr > 1)
+		g->map_class = DESTRIPE_MAP_MULTI;
+	else if (g->chunk_size_shift < 0)
+		g->map_class = DESTRIPE_MAP_GENERIC;
+	else if (g->destripes_shift < 0)
+		g->map_class = DESTRIPE_MAP_CHUNK_SHIFT;
+	else
+		g->map_class = DESTRIPE_MAP_SHIFT;
+
+	if (g->chunk_size_shift >= 0)
+		g->idx_bits = (uint64_t)g->destripe_idx << g->chunk_size_shift;
+	if (g->chunk_size_shift >= 0 && g->destripes_shift >= 0)
+		g->row_shift = g->chunk_size_shift + g->destripes_shift;
+}
+
+/* Single index geometry */
+static inline void destripe_geom_init(struct destripe_geom *g, uint32_t destripes,
+					uint32_t destripe_idx, uint32_t chunk_size)
+{
+	struct destripe_idx_set set = {
+		.layout = DESTRIPE_LAYOUT_INTERLEAVED,
+		.nr = 1,
+		.idx = { (uint8_t)destripe_idx },
+	};
+
+	destripe_geom_init_set(g, destripes, &set, chunk_size, 0);
+}
+
+static inline const char *destripe_map_class_name(const struct destripe_geom *g)
+{
+	switch (g->map_class) {
+	case DESTRIPE_MAP_SHIFT:
+		return "shift";
+	case DESTRIPE_MAP_CHUNK_SHIFT:
+		return "chunk_shift";
+	case DESTRIPE_MAP_MULTI:
+		return g->idx.layout == DESTRIPE_LAYOUT_CONCAT ? "concat" : "interleave";
+	default:
+		return "generic";
+	}
+}
+
+/*
+ * Map a sector offset within the destriped (target) address space
+ * to its sector offset on the striped source.
+ *
+ * All the arithmetic is done in 64 bits, also on 32-bit (NOT_64_ARCH) builds.
+ */
+static inline sector_t destripe_map_shift(const struct destripe_geom *g, uint64_t offset)
+{
+	/* chunk offset bits stay in place, the chunk (row) moves up by log2(destripes) */
+	return ((offset >> g->chunk_size_shift) << g->row_shift) | g->idx_bits |
+		(offset & g->chunk_mask);
+}
+
+static inline sector_t destripe_map_chunk_shift(const struct destripe_geom *g, uint64_t offset)
+{
+	/* spread chunk to stripe length */
+	return (((offset >> g->chunk_size_shift) * g->destripes) << g->chunk_size_shift) +
+		g->idx_bits + (offset & g->chunk_mask);
+}
+
+static inline sector_t destripe_map_generic(const struct destripe_geom *g, uint64_t offset)
+{
+	uint32_t chunk_offset;
+	uint64_t chunk = destripe_recip_divmod(&g->chunk_recip, offset, &chunk_offset);
+
+	return (chunk * g->destripes + g->destripe_idx) * g->chunk_size + chunk_offset;
+}
+
+/*
+ * Member of a concatenated target holding offset: a binary search over the
+ * member starts, without a division and without data dependent branches.
+ */
+static inline uint32_t destripe_concat_member(const struct destripe_geom *g, uint64_t offset)
+{
+	uint32_t member = 0, step, next;
+
+	for (step = g->concat_step; step; step >>= 1) {
+		next = member + step;
+		member = (next < g->idx.nr && next * g->member_len <= offset) ? next : member;
+	}
+	return member;
+}
+
+static inline sector_t destripe_map_multi(const struct destripe_geom *g, uint64_t offset)
+{
+	uint64_t chunk;
+	uint32_t chunk_offset, member = 0;
+
+	if (g->idx.layout == DESTRIPE_LAYOUT_CONCAT) {
+		member = destripe_concat_member(g, offset);
+		offset -= member * g->member_len;
+	}
+
+	if (g->chunk_size_shift < 0)
+		chunk = destripe_recip_divmod(&g->chunk_recip, offset, &chunk_offset);
+	else {
+		chunk_offset = offset & g->chunk_mask;
+		chunk = offset >> g->chunk_size_shift;
+	}
+
+	/* interleaved: target chunk -> (chunk of the member, member) */
+	if (g->idx.layout == DESTRIPE_LAYOUT_INTERLEAVED) {
+		if (g->nr_idx_shift < 0)
+			chunk = destripe_recip_divmod(&g->nr_idx_recip, chunk, &member);
+		else {
+			member = chunk & (g->idx.nr - 1);
+			chunk >>= g->nr_idx_shift;
+		}
+	}
+
+	chunk = chunk * g->destripes + g->idx.idx[member];
+	if (g->chunk_size_shift < 0)
+		return chunk * g->chunk_size + chunk_offset;
+	return (chunk << g->chunk_size_shift) + chunk_offset;
+}
+
+static inline sector_t destripe_geom_map(const struct destripe_geom *g, sector_t offset)
+{
+	/* one perfectly predicted branch per bio: the class never changes */
+	switch (g->map_class) {
+	case DESTRIPE_MAP_SHIFT:
+		return destripe_map_shift(g, offset);
+	case DESTRIPE_MAP_CHUNK_SHIFT:
+		return destripe_map_chunk_shift(g, offset);
+	case DESTRIPE_MAP_MULTI:
+		return destripe_map_multi(g, offset);
+	default:
+		return destripe_map_generic(g, offset);
+	}
+}
+
+/*
+ * Inverse of destripe_geom_map() for single index targets: map a sector offset
+ * on the striped source back to the stripe index owning it (*idx) and the sector
+ * offset within that stripe's destriped device. Does not depend on the indices
+ * of g, see destripe_geom_unmap_target() for multi index targets.
+ */
+static inline sector_t destripe_geom_unmap(const struct destripe_geom *g, sector_t phys,
+					uint32_t *idx)
+{
+	uint64_t chunk = phys;
+	uint32_t chunk_offset;
+
+	if (g->map_class == DESTRIPE_MAP_SHIFT) {
+		*idx = (uint32_t)((chunk >> g->chunk_size_shift) & (g->destripes - 1));
+		return ((chunk >> g->row_shift) << g->chunk_size_shift) | (chunk & g->chunk_mask);
+	}
+
+	if (g->chunk_size_shift < 0)
+		chunk = destripe_recip_divmod(&g->chunk_recip, chunk, &chunk_offset);
+	else {
+		chunk_offset = chunk & g->chunk_mask;
+		chunk >>= g->chunk_size_shift;
+	}
+
+	if (g->destripes_shift < 0)
+		chunk = destripe_recip_divmod(&g->destripes_recip, chunk, idx);
+	else {
+		*idx = (uint32_t)(chunk & (g->destripes - 1));
+		chunk >>= g->destripes_shift;
+	}
+
+	if (g->chunk_size_shift < 0)
+		chunk *= g->chunk_size;
+	else
+		chunk <<= g->chunk_size_shift;
+
+	return chunk + chunk_offset;
+}
+
+/*
+ * Inverse of destripe_geom_map() for any target: returns the target offset
+ * of the source sector phys, or -1 if phys belongs to an index the target
+ * does not expose.
+ */
+static inline sector_t destripe_geom_unmap_target(const struct destripe_geom *g, sector_t phys)
+{
+	uint32_t idx, member, chunk_offset;
+	sector_t offset = destripe_geom_unmap(g, phys, &idx);
+	uint64_t chunk;
+
+	for (member = 0; member < g->idx.nr; member++)
+		if (g->idx.idx[member] == idx)
+			break;
+	if (member == g->idx.nr)
+		return (sector_t)-1;
+
+	if (g->idx.nr == 1)
+		return offset;
+	if (g->idx.layout == DESTRIPE_LAYOUT_CONCAT)
+		return member * g->member_len + offset;
+
+	/* interleaved: chunk of the member -> target chunk */
+	if (g->chunk_size_shift < 0)
+		chunk = destripe_recip_divmod(&g->chunk_recip, offset, &chunk_offset);
+	else {
+		chunk_offset = offset & g->chunk_mask;
+		chunk = offset >> g->chunk_size_shift;
+	}
+	chunk = chunk * g->idx.nr + member;
+	if (g->chunk_size_shift < 0)
+		return chunk * g->chunk_size + chunk_offset;
+	return (chunk << g->chunk_size_shift) + chunk_offset;
+}
+
+/* Number of sectors from offset up to the end of its chunk */
+static inline uint32_t destripe_geom_chunk_left(const struct destripe_geom *g, sector_t offset)
+{
+	uint32_t chunk_offset;
+
+	if (g->chunk_size_shift < 0) {
+		destripe_recip_divmod(&g->chunk_recip, offset, &chunk_offset);
+		return g->chunk_size - chunk_offset;
+	}
+
+	return g->chunk_size - (uint32_t)(offset & g->chunk_mask);
+}
+
+#endif /* _DM_DESTRIPE_MAP_H */
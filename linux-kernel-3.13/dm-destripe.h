@@ -25,6 +25,37 @@
  *   CONFIGURABLE OPTIONS
  * -------------------------------------------------------------- */
 
+/* Max backing devices the striped source may be spread across */
+#define DESTRIPE_MAX_DEVS	256
+
+/* Latency histogram buckets, by log2(usecs): 0, 1, 2-3, 4-7 ... >= 2^22 (~4s) */
+#define DESTRIPE_LAT_BUCKETS	24
+
+/* Reserved bios in the split bioset (split_bios feature), shared by all targets */
+#define DESTRIPE_SPLIT_POOL_SIZE	64
+
+/* Stream detection & prefetch (prefetch feature) */
+#define DESTRIPE_RA_STREAMS	8	/* sequential read streams tracked per target */
+#define DESTRIPE_RA_TRIGGER	2	/* sequential reads before a stream is prefetched */
+#define DESTRIPE_RA_INIT_DEPTH	2	/* chunks prefetched ahead of a stream, initially */
+#define DESTRIPE_RA_MAX_DEPTH	16	/* chunks prefetched ahead of a stream, at most */
+#define DESTRIPE_RA_WINDOW	64	/* prefetched chunks used or wasted per depth adaptation */
+#define DESTRIPE_RA_MAX_MB	32	/* chunk cache size per target for prefetch alone */
+#define DESTRIPE_RA_HASH_BITS	6
+
+/* Chunk cache (cache feature) */
+#define DESTRIPE_CACHE_MB	64	/* default size per target, see the cache_mb message */
+#define DESTRIPE_CACHE_MAX_MB	65536
+#define DESTRIPE_CACHE_HASH_MAX_BITS	20	/* a hash bucket per cached chunk, at most (16MB of tables) */
+
+/* Full stripe row reads (row_reads feature) */
+#define DESTRIPE_ROW_MAX_KB	4096	/* largest stripe row (stripes * chunk size) read at once */
+
+/* Write coalescing (write_back feature) */
+#define DESTRIPE_WB_MAX_MB	16	/* chunks buffered per target, at most */
+#define DESTRIPE_WB_DELAY_MS	100	/* buffered writes are written back within */
+#define DESTRIPE_WB_HASH_BITS	6
+
 /* --------------------------------------------------------------
  *   NON-CONFIGURABLE OPTIONS - FRAGILE !
  * -------------------------------------------------------------- */
@@ -87,21 +118,139 @@ struct destripe {
 	sector_t physical_start;
 	sector_t physical_secs;
 
+	/* Part of the striped source on this device, see destripe_map_dev() */
+	sector_t source_start;
+	sector_t source_secs;
+
 	atomic_t error_count;
 };
 
+/* Optional features, enabled by the table feature args (see destripe_ctr()) */
+enum destripe_feature {
+	DSS_FEAT_SPLIT_BIOS = 0,	/* split multi-chunk bios in the target, not in dm core */
+	DSS_FEAT_PREFETCH,		/* sequential read stream detection & chunk prefetch */
+	DSS_FEAT_CACHE,			/* 2Q cache of the chunks read */
+	DSS_FEAT_ROW_READS,		/* read misses read the stripe row for the sibling targets */
+	DSS_FEAT_WRITE_BACK,		/* small writes coalesced per chunk & written back */
+	DSS_FEAT_MAX
+};
+
+/* Features that may be toggled by the feature message, see destripe_feature_set() */
+#define DSS_FEAT_RUNTIME	((1UL << DSS_FEAT_MAX) - 1)
+
+/* Features using the chunk cache */
+#define DSS_FEAT_CHUNK_CACHE	((1UL << DSS_FEAT_PREFETCH) | (1UL << DSS_FEAT_CACHE) | \
+				 (1UL << DSS_FEAT_ROW_READS))
+
+/* I/O types of the statistics */
+enum destripe_io_type {
+	DSS_IO_READ = 0,
+	DSS_IO_WRITE,		/* incl. WRITE SAME */
+	DSS_IO_DISCARD,
+	DSS_IO_FLUSH,		/* one per backing device flushed */
+	DSS_IO_MAX
+};
+
+/* I/O counters, by type */
+struct destripe_counters {
+	u64 ios[DSS_IO_MAX];	/* mapped */
+	u64 done[DSS_IO_MAX];	/* completed */
+	u64 bytes[DSS_IO_MAX];	/* mapped */
+};
+
+/* Per-CPU I/O statistics, see destripe_stats_fold() */
+struct destripe_stats {
+	struct destripe_counters cnt;
+	u64 lat[DSS_IO_MAX][DESTRIPE_LAT_BUCKETS];	/* completed, by map to end_io latency */
+};
+
+/* A sequential read stream, in target offsets (see destripe_ra_stream()) */
+struct destripe_stream {
+	sector_t next;		/* where the stream continues */
+	sector_t ra_next;	/* first chunk not prefetched yet */
+	unsigned int seq;	/* sequential reads seen, 0: unused slot */
+	unsigned long last;	/* jiffies of the last read, for replacement */
+};
+
+/* Chunk state bits */
+enum {
+	DSC_READING = 0,	/* whole chunk read in flight (prefetch), reads wait for it */
+	DSC_ERROR,		/* that read failed (or READA turned down) */
+	DSC_PREFETCHED,		/* read in by the prefetch */
+	DSC_HIT,		/* prefetched & served a read, for the prefetch hit rate */
+	DSC_AM,			/* on the Am queue (else A1in) */
+};
+
+/* A chunk of the striped source in the chunk cache (cache & prefetch features) */
+struct destripe_chunk {
+	struct hlist_node hash;		/* in dss->cache_hash, by key */
+	struct list_head lru;		/* on dss->cache_a1in or cache_am, most recent first */
+	sector_t key;			/* source sector of the chunk start */
+	sector_t offset;		/* target offset of the chunk start */
+	atomic_t ref;			/* hashed + read in flight + users */
+	atomic_t io_pending;		/* prefetch read bios in flight, +1 while submitting */
+	unsigned long state;		/* DSC_* bits */
+	struct bio_list waiters;	/* reads of the chunk waiting for it to be read in */
+	struct work_struct work;	/* prefetch read completion, destripe_ra_done() */
+	struct destripe_set *dss;
+	unsigned int nr_pages, nr_held;	/* pages of a chunk, allocated */
+	unsigned long *valid;		/* pages holding data, bitmap after pages[] */
+	struct page *pages[0];
+};
+
+/* A1out: key of a chunk evicted from A1in lately */
+struct destripe_ghost {
+	struct hlist_node hash;		/* in dss->ghost_hash */
+	struct list_head list;		/* on dss->cache_a1out, most recent first */
+	sector_t key;
+};
+
+/* Write-back buffer state bits */
+enum {
+	DSW_WRITING = 0,	/* being written back, its I/O waits on deferred */
+};
+
+/* Writes buffered for a chunk of the striped source (write_back feature) */
+struct destripe_wbuf {
+	struct hlist_node hash;		/* in dss->wb_hash, by key */
+	struct list_head list;		/* on dss->wb_dirty, or the write back batch */
+	sector_t key;			/* source sector of the chunk start */
+	sector_t offset;		/* target offset of the chunk start */
+	unsigned long state;		/* DSW_* bits */
+	atomic_t io_pending;		/* write back bios in flight, +1 while submitting */
+	int error;
+	struct bio_list deferred;	/* I/O overlapping the buffer, waiting for the write back */
+	struct work_struct work;	/* write back completion, destripe_wb_done() */
+	struct destripe_set *dss;
+	unsigned int nr_pages;
+	unsigned long *dirty;		/* sectors buffered, bitmap after pages[] */
+	struct page *pages[0];
+};
+
+/* A full stripe row read (row_reads feature), see destripe_row_read() */
+struct destripe_row {
+	atomic_t pending;		/* row bios in flight, +1 while submitting */
+	int error;
+	unsigned int nr;		/* stripes */
+	struct destripe_chunk *chunks[0];	/* by stripe index, NULL: read into the sink page */
+};
+
+/* Row_reads targets destriping the same source, on destripe_groups */
+struct destripe_group {
+	struct list_head list;
+	struct list_head members;	/* dss->group_list */
+	u64 idx_mask;			/* stripe indices exposed by the members */
+};
+
 #define DEVNAME_MAXLEN 16
 
 struct destripe_set {
-	uint32_t destripes;
-	uint32_t destripe_idx;
+	/* Stripe count, index & chunking of the striped source (see dm-destripe-map.h) */
+	struct destripe_geom geom;
 
 	/* The physical size of this target == target len * num. of de-stripes */
 	sector_t physical_size;
 
-	uint32_t chunk_size;
-	int chunk_size_shift;
-
 	/* Needed for handling events */
 	struct dm_target *ti;
 
@@ -109,17 +258,71 @@ struct destripe_set {
 
 	atomic_t suspend; /* flag set for suspend... */
 
+	unsigned long features;	/* DSS_FEAT_* bits */
+
+	unsigned int nr_devs;	/* backing devices, destripe[nr_devs] */
+
 	/* Total & Outstanding I/O counters */
-	atomic_t read_ios_total;
-	atomic_t read_ios_pending;
-	atomic_t write_ios_total;
-	atomic_t write_ios_pending;
+	struct destripe_stats __percpu *stats;
+	struct destripe_stats stats_base;	/* totals at the last reset_stats */
+
+	unsigned int err_threshold;	/* device errors triggering a dm event */
+
+	/* Chunk cache (cache & prefetch features) & read streams, under cache_lock */
+	spinlock_t cache_lock;
+	struct hlist_head *cache_hash, *ghost_hash;
+	unsigned int cache_hash_bits;
+	struct list_head cache_a1in, cache_am, cache_a1out;	/* 2Q queues */
+	unsigned int cache_nr, cache_nr_ghosts;
+	unsigned int cache_pages, cache_a1in_pages;	/* charged pages, see destripe_cache_charge() */
+	unsigned int cache_max_pages, cache_max_chunks, cache_max_ghosts;
+	unsigned int cache_mb;		/* size with the cache feature */
+	u64 cache_hits, cache_misses;
+	struct shrinker cache_shrinker;
+
+	struct destripe_stream ra_streams[DESTRIPE_RA_STREAMS];
+	unsigned int ra_depth;		/* chunks prefetched ahead, adapted to the hit rate */
+	unsigned int ra_win_hits, ra_win_wasted;	/* current adaptation window */
+	u64 ra_issued, ra_hits, ra_wasted;
+	atomic_t ra_inflight;		/* chunks being read in */
+	wait_queue_head_t ra_wait;
+
+	/* Sibling targets (row_reads feature), under destripe_groups_lock */
+	struct destripe_group *group;	/* while resumed */
+	struct list_head group_list;
+	u64 row_reads, row_handed;	/* rows read, chunks handed to siblings */
+
+	/* Write-back buffers (write_back feature), under wb_lock */
+	spinlock_t wb_lock;
+	struct hlist_head wb_hash[1 << DESTRIPE_WB_HASH_BITS];
+	struct list_head wb_dirty;	/* buffers not being written back, by creation */
+	struct bio_list wb_flushes;	/* flushes for the next write back */
+	struct bio_list wb_flushing;	/* flushes waiting for the buffers being written */
+	unsigned int wb_nr, wb_max;	/* buffers (incl. being written back) */
+	bool wb_suspended;		/* writes go straight to the devices */
+	int wb_error;			/* a write back failed, reported to the next flush */
+	atomic_t wb_writing;		/* buffers being written back (+1 while submitting) */
+	wait_queue_head_t wb_wait;
+	struct delayed_work wb_work;	/* destripe_wb_work() */
+	u64 wb_buffered, wb_written, wb_deferred;	/* writes, chunks written, I/O deferred */
 
 	/* Work struct used for triggering events*/
 	struct work_struct trigger_event;
 
 	char name[ DEVNAME_MAXLEN ];
+	char idx_spec[ DESTRIPE_IDX_SPEC_MAXLEN + 1 ];	/* <de-stripe index> table arg */
 
 	struct destripe destripe[0];
 };
 
+/* Per bio data (ti->per_bio_data_size) */
+struct destripe_io {
+	ktime_t start;		/* mapped at, for the latency histograms */
+	atomic_t pending;	/* in-flight split clones, +1 while still submitting */
+	int error;
+	sector_t offset;	/* writes: target range, invalidated again at end_io */
+	unsigned int sectors;
+	struct destripe_chunk *chunk;	/* cache miss: chunk to fill at end_io */
+	struct bvec_iter iter;		/* the data read, for the fill */
+};
+
@@ -25,6 +25,12 @@
  *   CONFIGURABLE OPTIONS
  * -------------------------------------------------------------- */
 
+/* Max backing devices the striped source may be spread across */
+#define DESTRIPE_MAX_DEVS	256
+
+/* Latency histogram buckets, by log2(usecs): 0, 1, 2-3, 4-7 ... >= 2^22 (~4s) */
+#define DESTRIPE_LAT_BUCKETS	24
+
 /* --------------------------------------------------------------
  *   NON-CONFIGURABLE OPTIONS - FRAGILE !
  * -------------------------------------------------------------- */
@@ -87,21 +93,54 @@ struct destripe {
 	sector_t physical_start;
 	sector_t physical_secs;
 
+	/* Part of the striped source on this device, see destripe_map_dev() */
+	sector_t source_start;
+	sector_t source_secs;
+
 	atomic_t error_count;
 };
 
+/* Optional features, enabled by the table feature args (see destripe_ctr()) */
+enum destripe_feature {
+	DSS_FEAT_SPLIT_BIOS = 0,	/* split multi-chunk bios in the target, not in dm core */
+	DSS_FEAT_PREFETCH,		/* sequential read stream detection & chunk prefetch */
+	DSS_FEAT_CACHE,			/* 2Q cache of the chunks read */
+	DSS_FEAT_ROW_READS,		/* read misses read the stripe row for the sibling targets */
+	DSS_FEAT_WRITE_BACK,		/* small writes coalesced per chunk & written back */
+	DSS_FEAT_MAX
+};
+
+/* I/O types of the statistics */
+enum destripe_io_type {
+	DSS_IO_READ = 0,
+	DSS_IO_WRITE,		/* incl. WRITE SAME */
+	DSS_IO_DISCARD,
+	DSS_IO_FLUSH,		/* one per backing device flushed */
+	DSS_IO_MAX
+};
+
+/* I/O counters, by type */
+struct destripe_counters {
+	u64 ios[DSS_IO_MAX];	/* mapped */
+	u64 done[DSS_IO_MAX];	/* completed */
+	u64 bytes[DSS_IO_MAX];	/* mapped */
+};
+
+/* Per-CPU I/O statistics, see destripe_stats_fold() */
+struct destripe_stats {
+	struct destripe_counters cnt;
+	u64 lat[DSS_IO_MAX][DESTRIPE_LAT_BUCKETS];	/* completed, by map to end_io latency */
+};
+
 #define DEVNAME_MAXLEN 16
 
 struct destripe_set {
-	uint32_t destripes;
-	uint32_t destripe_idx;
+	/* Stripe count, index & chunking of the striped source (see dm-destripe-map.h) */
+	struct destripe_geom geom;
 
 	/* The physical size of this target == target len * num. of de-stripes */
 	sector_t physical_size;
 
-	uint32_t chunk_size;
-	int chunk_size_shift;
-
 	/* Needed for handling events */
 	struct dm_target *ti;
 
@@ -109,16 +148,21 @@ struct destripe_set {
 
 	atomic_t suspend; /* flag set for suspend... */
 
+	unsigned long features;	/* DSS_FEAT_* bits */
+
+	unsigned int nr_devs;	/* backing devices, destripe[nr_devs] */
+
 	/* Total & Outstanding I/O counters */
-	atomic_t read_ios_total;
-	atomic_t read_ios_pending;
-	atomic_t write_ios_total;
-	atomic_t write_ios_pending;
+	struct destripe_stats __percpu *stats;
+	struct destripe_stats stats_base;	/* totals at the last reset_stats */
+
+	unsigned int err_threshold;	/* device errors triggering a dm event */
 
 	/* Work struct used for triggering events*/
 	struct work_struct trigger_event;
 
 	char name[ DEVNAME_MAXLEN ];
+	char idx_spec[ DESTRIPE_IDX_SPEC_MAXLEN + 1 ];	/* <de-stripe index> table arg */
 
 	struct destripe destripe[0];
 };
@@ -38,62 +38,201 @@
 #include <linux/delay.h>
 #include <linux/vmalloc.h>
 #include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
 
+#include "dm-destripe-map.h"	/* Shared destripe mapping core */
 #include "dm-destripe.h"		/* Local destripe header file */
 
 #define DM_MSG_PREFIX "destripe"
 #define DM_IO_ERROR_THRESHOLD 15
 
+/* I/O type names, indexed by enum destripe_io_type */
+static const char *destripe_io_type_names[DSS_IO_MAX] = {
+	[DSS_IO_READ] = "read",
+	[DSS_IO_WRITE] = "write",
+	[DSS_IO_DISCARD] = "discard",
+	[DSS_IO_FLUSH] = "flush",
+};
+
+/* Table feature arg names, indexed by enum destripe_feature */
+static const char *destripe_feature_names[DSS_FEAT_MAX] = {
+	[DSS_FEAT_SPLIT_BIOS] = "split_bios",
+	[DSS_FEAT_PREFETCH] = "prefetch",
+	[DSS_FEAT_CACHE] = "cache",
+	[DSS_FEAT_ROW_READS] = "row_reads",
+	[DSS_FEAT_WRITE_BACK] = "write_back",
+};
 
-static void destripe_map_sector(struct destripe_set *dss,
+
+/* Backing device holding source sector phys: binary search of the device starts */
+static inline struct destripe *destripe_map_dev(struct destripe_set *dss, sector_t phys)
+{
+	unsigned int lo = 0, hi = dss->nr_devs - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) >> 1;
+		if (dss->destripe[mid].source_start <= phys)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &dss->destripe[lo];
+}
+
+/* Map a target sector to its backing device & the sector on that device */
+static inline struct destripe *destripe_map_sector(struct destripe_set *dss,
 					sector_t sector, sector_t *mapped_sec)
 {
-	sector_t chunk = dm_target_offset(dss->ti, sector);
-	sector_t chunk_offset, stripe_set_offset;
+	sector_t offset = dm_target_offset(dss->ti, sector);
+	sector_t phys = destripe_geom_map(&dss->geom, offset);
+	struct destripe *d = destripe_map_dev(dss, phys);
+
+	DRSDEBUG("destripe_map_sector() ENTER  sector= %lu, offset= %lu \n",
+				(unsigned long)sector, (unsigned long)offset );
+
+	*mapped_sec = phys - d->source_start + d->physical_start;
+
+	DRSDEBUG("destripe_map_sector() END    map_sec= %lu\n", (unsigned long)*mapped_sec );
+	return d;
+}
+
+/*----------------------------------------------------------------- */
+
+/*
+ * I/O statistics: per-CPU 64-bit counters, so that the map & end_io paths
+ * never share a cache line between cores. Folded by destripe_status().
+ */
+static inline int destripe_io_type(struct bio *bio)
+{
+	if (bio->bi_rw & REQ_FLUSH)
+		return DSS_IO_FLUSH;
+	if (bio->bi_rw & REQ_DISCARD)
+		return DSS_IO_DISCARD;
+	return bio_data_dir(bio) == WRITE ? DSS_IO_WRITE : DSS_IO_READ;
+}
+
+static inline void destripe_account(struct destripe_set *dss, int type, unsigned int bytes)
+{
+	this_cpu_inc(dss->stats->cnt.ios[type]);
+	this_cpu_add(dss->stats->cnt.bytes[type], bytes);
+}
+
+/* Completion of a bio mapped at start: latency goes to bucket log2(usecs) */
+static inline void destripe_account_done(struct destripe_set *dss, struct bio *bio,
+					ktime_t start)
+{
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+	int type = destripe_io_type(bio);
+	int bucket = us > 0 ? fls64(us) : 0;
 
-	DRSDEBUG("destripe_map_sector() ENTER  sector= %lu, chunk= %lu \n",
-				(unsigned long)sector, (unsigned long)chunk );
+	if (bucket >= DESTRIPE_LAT_BUCKETS)
+		bucket = DESTRIPE_LAT_BUCKETS - 1;
 
-	if (dss->chunk_size_shift < 0)
-		chunk_offset = sector_div(chunk, dss->chunk_size);
-	else {
-		chunk_offset = chunk & (dss->chunk_size - 1);
-		chunk >>= dss->chunk_size_shift;
+	this_cpu_inc(dss->stats->cnt.done[type]);
+	this_cpu_inc(dss->stats->lat[type][bucket]);
+}
+
+static void destripe_stats_fold(struct destripe_set *dss, struct destripe_counters *sum)
+{
+	struct destripe_counters *cnt;
+	int cpu, type;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		cnt = &per_cpu_ptr(dss->stats, cpu)->cnt;
+		for (type = 0; type < DSS_IO_MAX; type++) {
+			sum->ios[type] += cnt->ios[type];
+			sum->done[type] += cnt->done[type];
+			sum->bytes[type] += cnt->bytes[type];
+		}
 	}
+}
 
-	stripe_set_offset = chunk * dss->destripes; /* spread chunk to stripe length */
+/* Latency histogram of one I/O type, folded over the CPUs */
+static void destripe_stats_fold_latency(struct destripe_set *dss, int type, u64 *hist)
+{
+	int cpu, b;
 
-	chunk = stripe_set_offset + dss->destripe_idx;
+	memset(hist, 0, sizeof(u64) * DESTRIPE_LAT_BUCKETS);
+	for_each_possible_cpu(cpu)
+		for (b = 0; b < DESTRIPE_LAT_BUCKETS; b++)
+			hist[b] += per_cpu_ptr(dss->stats, cpu)->lat[type][b];
+}
+
+/*
+ * Latency (usecs) below which permille/1000 of the I/Os of a folded histogram
+ * fall: the upper bound of the bucket holding that rank.
+ */
+static u64 destripe_latency_percentile(const u64 *hist, unsigned int permille)
+{
+	u64 total = 0, acc = 0;
+	int b;
+
+	for (b = 0; b < DESTRIPE_LAT_BUCKETS; b++)
+		total += hist[b];
+	if (!total)
+		return 0;
+
+	for (b = 0; b < DESTRIPE_LAT_BUCKETS - 1; b++) {
+		acc += hist[b];
+		if (acc * 1000 >= total * permille)
+			break;
+	}
+	return (1ULL << b) - 1;
+}
+
+/*
+ * reset_stats message: the current totals become the base that status
+ * subtracts, so that the per-CPU counters are never written but by their CPU
+ * and the outstanding counts stay right across a reset.
+ */
+static void destripe_stats_reset(struct destripe_set *dss)
+{
+	int type;
+
+	destripe_stats_fold(dss, &dss->stats_base.cnt);
+	for (type = 0; type < DSS_IO_MAX; type++)
+		destripe_stats_fold_latency(dss, type, dss->stats_base.lat[type]);
+}
 
-	if (dss->chunk_size_shift < 0)
-		chunk *= dss->chunk_size;
-	else
-		chunk <<= dss->chunk_size_shift;
+/* Folded counters since the last reset */
+static void destripe_stats_rebase(struct destripe_set *dss, struct destripe_counters *sum)
+{
+	struct destripe_counters *base = &dss->stats_base.cnt;
+	int type;
 
-	*mapped_sec = chunk + chunk_offset;
+	for (type = 0; type < DSS_IO_MAX; type++) {
+		sum->ios[type] -= base->ios[type];
+		sum->done[type] -= base->done[type];
+		sum->bytes[type] -= base->bytes[type];
+	}
+}
 
-	DRSDEBUG("destripe_map_sector() END    map_sec= %lu, chunk= %lu, chunk_offset= %lu\n",
-				(unsigned long)*mapped_sec, (unsigned long)chunk, (unsigned long)chunk_offset );
+/* Outstanding I/Os of a type, from folded stats (not a snapshot: may be off by a few) */
+static inline u64 destripe_stats_pending(struct destripe_counters *sum, int type)
+{
+	return sum->ios[type] > sum->done[type] ? sum->ios[type] - sum->done[type] : 0;
 }
 
 /*----------------------------------------------------------------- */
 
+/*
+ * Discards & WRITE SAME: each chunk of the target maps to its own extent of
+ * the striped source, the next chunks belonging to the other stripes. dm core
+ * cuts them per chunk (split_discard_requests, max_io_len), one still spanning
+ * chunks is cut at the end of its first one: never touch the data of the
+ * other stripes.
+ */
 static int destripe_map_range(struct destripe_set *dss, struct bio *bio)
 {
-	sector_t begin, end;
-
-	destripe_map_sector(dss, bio->bi_sector, &begin);
-	destripe_map_sector(dss, bio->bi_sector + bio_sectors(bio), &end);
-	if (begin < end) {
-		bio->bi_bdev = dss->destripe[0].dev->bdev;
-		bio->bi_sector = begin + dss->destripe[0].physical_start;
-		bio->bi_size = to_bytes(end - begin);
-		return DM_MAPIO_REMAPPED;
-	} else {
-		/* The range doesn't map to the target stripe */
-		bio_endio(bio, 0);
-		return DM_MAPIO_SUBMITTED;
-	}
+	sector_t offset = dm_target_offset(dss->ti, bio->bi_sector);
+	unsigned int len = min_t(unsigned int, bio_sectors(bio),
+				destripe_geom_chunk_left(&dss->geom, offset));
+
+	bio->bi_bdev = destripe_map_sector(dss, bio->bi_sector, &bio->bi_sector)->dev->bdev;
+	bio->bi_size = to_bytes(len);
+	return DM_MAPIO_REMAPPED;
 }
 /* ----------------------------------------------------------------
  * Destripe mapping function -> All the I/O action goes through here!
@@ -101,23 +240,26 @@ static int destripe_map_range(struct destripe_set *dss, struct bio *bio)
 static int destripe_map(struct dm_target *ti, struct bio *bio)
 {
 	struct destripe_set *dss = ti->private;
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
 	int rw = bio_rw(bio);
 
+	io->start = ktime_get();
+
 	if (bio->bi_rw & REQ_FLUSH) {
-		BUG_ON(dm_bio_get_target_request_nr(bio) != 0);
-		bio->bi_bdev = dss->destripe[0].dev->bdev;
+		destripe_account(dss, DSS_IO_FLUSH, 0);
+
+		/* one flush per backing device (ti->num_flush_requests) */
+		bio->bi_bdev = dss->destripe[dm_bio_get_target_request_nr(bio)].dev->bdev;
 		return DM_MAPIO_REMAPPED;
 	}
 	if (unlikely(bio->bi_rw & REQ_DISCARD) ||
 	    unlikely(bio->bi_rw & REQ_WRITE_SAME)) {
 		BUG_ON(dm_bio_get_target_request_nr(bio) != 0);
+		destripe_account(dss, destripe_io_type(bio), bio->bi_size);
 		return destripe_map_range(dss, bio);
 	}
 
-	destripe_map_sector(dss, bio->bi_sector, &bio->bi_sector);
-
-	bio->bi_sector += dss->destripe[0].physical_start;
-	bio->bi_bdev = dss->destripe[0].dev->bdev;
+	bio->bi_bdev = destripe_map_sector(dss, bio->bi_sector, &bio->bi_sector)->dev->bdev;
 
 	/* Handling writes... fwd them and get a callback at destripe_end_io() */
 	if (rw == WRITE) {
@@ -125,16 +267,14 @@ static int destripe_map(struct dm_target *ti, struct bio *bio)
 		DRSDEBUG("[%s] dm-destripe REQ: WRITE Addr: %lld Size: %d\n", dm_device_name(dsd),
 		   				(unsigned long long)bio->bi_sector << 9, bio->bi_size);
 
-		atomic_inc( &dss->write_ios_total );
-	   	atomic_inc( &dss->write_ios_pending );
+		destripe_account(dss, DSS_IO_WRITE, bio->bi_size);
 
 	} else { /* It's all about the reads here... */
 
 		DRSDEBUG("[%s] dm-destripe REQ: READ Addr: %lld Size: %d\n", dm_device_name(dsd),
 						(unsigned long long)bio->bi_sector << 9, bio->bi_size);
 
-		atomic_inc( &dss->read_ios_total );
-	   	atomic_inc( &dss->read_ios_pending );
+		destripe_account(dss, DSS_IO_READ, bio->bi_size);
 	}
 
 	return DM_MAPIO_REMAPPED;
@@ -148,15 +288,14 @@ static int destripe_map(struct dm_target *ti, struct bio *bio)
 static int destripe_end_io(struct dm_target *ti, struct bio *bio, int error)
 {
 	struct destripe_set *dss = (struct destripe_set *) ti->private;
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
 	char major_minor[16];
+	unsigned int i;
 
 	DRSDEBUG_CALL("destripe_end_io called...\n");
 
-	/* Update our pending I/O counters... */
-	if ( bio_rw(bio) == WRITE)
-	   	atomic_dec( &dss->write_ios_pending );
-	else
-		atomic_dec( &dss->read_ios_pending );
+	/* Update our completed I/O counters & latency histograms... */
+	destripe_account_done(dss, bio, io->start);
 
 	if (!error)
 		return 0; /* No error, I/O completed successfully */
@@ -179,12 +318,13 @@ static int destripe_end_io(struct dm_target *ti, struct bio *bio, int error)
 	 * If the error count for a given device exceeds the threshold
 	 * value we will no longer trigger any further events.
 	 */
-	if (!strcmp(dss->destripe[0].dev->name, major_minor)) {
-		atomic_inc(&(dss->destripe[0].error_count));
-		if (atomic_read(&(dss->destripe[0].error_count)) <
-		    DM_IO_ERROR_THRESHOLD)
-			schedule_work(&dss->trigger_event);
-	}
+	for (i = 0; i < dss->nr_devs; i++)
+		if (!strcmp(dss->destripe[i].dev->name, major_minor)) {
+			atomic_inc(&(dss->destripe[i].error_count));
+			if (atomic_read(&(dss->destripe[i].error_count)) <
+			    ACCESS_ONCE(dss->err_threshold))
+				schedule_work(&dss->trigger_event);
+		}
 
 	return error;
 }
@@ -226,18 +366,21 @@ static void destripe_resume(struct dm_target *ti)
 
 /*----------------------------------------------------------------- */
 
-/* Set read policy & parameters via the message interface. */
+/* Runtime tuning via the message interface, no suspend/reload needed. */
 static int destripe_message(struct dm_target *ti, unsigned argc, char **argv)
 {
 	struct destripe_set *dss = ti->private;
-	//char dummy;
+	unsigned int val, f;
 
 	DRSDEBUG_CALL("destripe_message called...\n");
 
 	/* INFO: valid message forms [ALWAYS 4 args - use 0 for unused values]:
 	 * io_cmd <command_type> <cmd_arg1> <cmd_arg2>
 	 *
-	 * io_cmd could be: ...
+	 * io_cmd could be:
+	 *   io_cmd reset_stats 0 0            : restart the status I/O counters & latencies
+	 *   io_cmd reset_errors 0 0           : zero the device error counts (re-arms events)
+	 *   io_cmd err_threshold <errors> 0   : device errors triggering a dm event (default 15)
 	 */
 	if (argc != 4 || strncmp(argv[0], "io_cmd", strlen(argv[0])) ) {
 
@@ -245,7 +388,30 @@ static int destripe_message(struct dm_target *ti, unsigned argc, char **argv)
 		return -EINVAL;
 	}
 
-	DMERR("[%s] No command currently implemented via message", dss->name);
+	if (!strcasecmp(argv[1], "reset_stats")) {
+		destripe_stats_reset(dss);
+		DMINFO("[%s] I/O statistics reset", dss->name);
+		return 0;
+	}
+
+	if (!strcasecmp(argv[1], "reset_errors")) {
+		for (f = 0; f < dss->nr_devs; f++)
+			atomic_set(&dss->destripe[f].error_count, 0);
+		DMINFO("[%s] Device error counts reset", dss->name);
+		return 0;
+	}
+
+	if (!strcasecmp(argv[1], "err_threshold")) {
+		if (kstrtouint(argv[2], 10, &val) || !val) {
+			DMERR("[%s] Invalid error threshold %s", dss->name, argv[2]);
+			return -EINVAL;
+		}
+		dss->err_threshold = val;
+		DMINFO("[%s] Error event threshold set to %u", dss->name, val);
+		return 0;
+	}
+
+	DMERR("[%s] Unknown io_cmd %s", dss->name, argv[1]);
 	return -EINVAL;
 }
 
@@ -256,27 +422,70 @@ static int destripe_message(struct dm_target *ti, unsigned argc, char **argv)
 static void destripe_status(struct dm_target *ti, status_type_t type,
 			 unsigned status_flags, char *result, unsigned int maxlen)
 {
-	unsigned int sz = 0;
+	unsigned int sz = 0, nr_features, i;
 	struct destripe_set *dss = (struct destripe_set *) ti->private;
+	struct destripe_counters sum;
+	u64 hist[DESTRIPE_LAT_BUCKETS], rd_pending, wr_pending;
+	int b;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
 		DRSDEBUG("destripe_status STATUSTYPE_INFO...\n");
-		DMEMIT("\ndestripe[%s] stripes=%u idx=%u"
+		DMEMIT("\ndestripe[%s] stripes=%u idx=%s "
 				"chunk_size=%u chunk_size_shift=%d phys_size=%lu",
-				dss->name, dss->destripes, dss->destripe_idx,
-				dss->chunk_size, dss->chunk_size_shift,
+				dss->name, dss->geom.destripes, dss->idx_spec,
+				dss->geom.chunk_size, dss->geom.chunk_size_shift,
 				(unsigned long)dss->physical_size);
-		DMEMIT("\ndestripe[%s] IO Count: TRD: %d ORD: %d TWR: %d OWR: %d", dss->name,
-				atomic_read( &dss->read_ios_total ), atomic_read( &dss->read_ios_pending ),
-				atomic_read( &dss->write_ios_total ), atomic_read( &dss->write_ios_pending) );
+		for (i = 0; i < dss->nr_devs; i++)
+			DMEMIT("\ndestripe[%s] dev %u: %s source=%llu+%llu errors=%d", dss->name, i,
+				dss->destripe[i].dev->name,
+				(unsigned long long)dss->destripe[i].source_start,
+				(unsigned long long)dss->destripe[i].source_secs,
+				atomic_read(&dss->destripe[i].error_count));
+		destripe_stats_fold(dss, &sum);
+		rd_pending = destripe_stats_pending(&sum, DSS_IO_READ);
+		wr_pending = destripe_stats_pending(&sum, DSS_IO_WRITE);
+		destripe_stats_rebase(dss, &sum);
+		DMEMIT("\ndestripe[%s] IO Count: TRD: %llu ORD: %llu TWR: %llu OWR: %llu", dss->name,
+				(unsigned long long)sum.ios[DSS_IO_READ], (unsigned long long)rd_pending,
+				(unsigned long long)sum.ios[DSS_IO_WRITE], (unsigned long long)wr_pending);
+		DMEMIT("\ndestripe[%s] IO Bytes: RD: %llu WR: %llu DISCARD: %llu (%llu ios) FLUSH: %llu ios",
+				dss->name, (unsigned long long)sum.bytes[DSS_IO_READ],
+				(unsigned long long)sum.bytes[DSS_IO_WRITE],
+				(unsigned long long)sum.bytes[DSS_IO_DISCARD],
+				(unsigned long long)sum.ios[DSS_IO_DISCARD],
+				(unsigned long long)sum.ios[DSS_IO_FLUSH]);
+		for (i = 0; i < DSS_IO_MAX; i++) {
+			if (!sum.done[i])
+				continue;
+			destripe_stats_fold_latency(dss, i, hist);
+			for (b = 0; b < DESTRIPE_LAT_BUCKETS; b++)
+				hist[b] -= dss->stats_base.lat[i][b];
+			DMEMIT("\ndestripe[%s] Latency %s (us): p50<=%llu p90<=%llu "
+					"p99<=%llu p99.9<=%llu max<=%llu", dss->name,
+					destripe_io_type_names[i],
+					(unsigned long long)destripe_latency_percentile(hist, 500),
+					(unsigned long long)destripe_latency_percentile(hist, 900),
+					(unsigned long long)destripe_latency_percentile(hist, 990),
+					(unsigned long long)destripe_latency_percentile(hist, 999),
+					(unsigned long long)destripe_latency_percentile(hist, 1000));
+		}
 		break;
 
 	case STATUSTYPE_TABLE:
 		DRSDEBUG("destripe_status STATUSTYPE_TABLE...\n");
-		DMEMIT("1 %llu %s %llu", (unsigned long long)dss->chunk_size,
-				dss->destripe[0].dev->name,
-				(unsigned long long)dss->destripe[0].physical_start);
+		DMEMIT("%u %s %u %u", dss->geom.destripes, dss->idx_spec,
+				dss->geom.chunk_size, dss->nr_devs);
+		for (i = 0; i < dss->nr_devs; i++)
+			DMEMIT(" %s %llu", dss->destripe[i].dev->name,
+				(unsigned long long)dss->destripe[i].physical_start);
+		nr_features = hweight_long(dss->features);
+		if (nr_features) {
+			DMEMIT(" %u", nr_features);
+			for (i = 0; i < DSS_FEAT_MAX; i++)
+				if (test_bit(i, &dss->features))
+					DMEMIT(" %s", destripe_feature_names[i]);
+		}
 		break;
 	}
 }
@@ -294,14 +503,14 @@ static void trigger_event(struct work_struct *work)
 	dm_table_event(dss->ti->table);
 }
 
-static inline struct destripe_set *alloc_ds_context(void)
+static inline struct destripe_set *alloc_ds_context(unsigned int nr_devs)
 {
 	size_t len;
 
-	if (dm_array_too_big(sizeof(struct destripe_set), sizeof(struct destripe), 1))
+	if (dm_array_too_big(sizeof(struct destripe_set), sizeof(struct destripe), nr_devs))
 		return NULL;
 
-	len = sizeof(struct destripe_set) + sizeof(struct destripe);
+	len = sizeof(struct destripe_set) + nr_devs * sizeof(struct destripe);
 
 	return kmalloc(len, GFP_KERNEL);
 }
@@ -310,20 +519,121 @@ static inline struct destripe_set *alloc_ds_context(void)
  * Target functions
  *---------------------------------------------------------------*/
 
+/* Parse the optional feature args: [<#feature args> <feature>...] */
+static int destripe_parse_features(struct dm_target *ti, unsigned int argc, char **argv,
+				unsigned long *features)
+{
+	unsigned int nr_features, i, f;
+
+	*features = 0;
+	if (!argc)
+		return 0;
+
+	if (kstrtouint(argv[0], 10, &nr_features) || nr_features != argc - 1) {
+		ti->error = "Invalid number of feature args";
+		return -EINVAL;
+	}
+
+	for (i = 1; i < argc; i++) {
+		for (f = 0; f < DSS_FEAT_MAX; f++)
+			if (!strcasecmp(argv[i], destripe_feature_names[f]))
+				break;
+		if (f == DSS_FEAT_MAX) {
+			ti->error = "Unrecognised destripe feature requested";
+			return -EINVAL;
+		}
+		set_bit(f, features);
+	}
+	return 0;
+}
+
+/*
+ * Get destination device i from its <dev path> <offset> pair. It holds the
+ * source sectors from source_start, up to the end of the device.
+ */
+static int destripe_get_dev(struct dm_target *ti, struct destripe_set *dss, unsigned int i,
+			char **argv, sector_t source_start)
+{
+	struct destripe *d = &dss->destripe[i];
+	unsigned long long start;
+	sector_t width;
+	char dummy;
+	int r;
+
+	if (sscanf(argv[1], "%llu%c", &start, &dummy) != 1) {
+		ti->error = "Couldn't parse destripe destination device";
+		return -EINVAL;
+	}
+
+	if (dm_get_device(ti, argv[0],
+			dm_table_get_mode(ti->table), &d->dev)) {
+		ti->error = "Invalid destripe destination device";
+		return -ENXIO;
+	}
+
+	r = ioctl_by_bdev( d->dev->bdev, BLKGETSIZE, (sector_t) &d->physical_secs );
+	if (r) {
+		ti->error = "Error reading physical device size via BLKGETSIZE ioctl()";
+		goto fail_dev;
+	}
+
+	if (start >= d->physical_secs) {
+		ti->error = "Destination device offset beyond the device size";
+		goto fail_dev;
+	}
+
+	d->physical_start = start;
+	d->source_start = source_start;
+	d->source_secs = d->physical_secs - start;
+	atomic_set(&(d->error_count), 0);
+
+	if (i && source_start >= dss->physical_size) {
+		ti->error = "More destination devices than needed for the target length";
+		goto fail_dev;
+	}
+
+	/* a chunk must not straddle two devices, so only the last may end unaligned */
+	width = d->source_secs;
+	if (i < dss->nr_devs - 1 && sector_div(width, dss->geom.chunk_size)) {
+		ti->error = "Destination device size (from offset) not a multiple of chunk size";
+		goto fail_dev;
+	}
+
+	return 0;
+
+fail_dev:
+	dm_put_device(ti, d->dev);
+	return -EINVAL;
+}
+
 /*
  * Construct a destripe (reverse stripe) mapping:
  *
  * Arguments: <number of stripes> <de-stripe index> <chunk size (sectors)> <...device arguments...>
+ *            [<#feature args> <feature>...]
+ *
+ * De-stripe index: <idx> exposes one stripe index, <idx>,<idx>,... several of them
+ * interleaved (re-striped with the same chunk size), <idx>+<idx>+... several of them
+ * concatenated. The target length must be a multiple of chunk size * indices.
  *
+ * Device arguments: <#devs> <dev path> <offset (sectors)> [<dev path> <offset>...]
+ *   The striped source is the concatenation of the devices, each from its
+ *   offset up to its end. All but the last must hold a whole number of chunks.
+ *
+ * Features:
+ *   split_bios: bios spanning several chunks are split into per-chunk clones
+ *               by the target, instead of dm core cloning & mapping each chunk.
  */
 static int destripe_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
 	struct destripe_set *dss;
 	struct mapped_device *dsd;
-	sector_t width;
-	uint32_t destripes, destripe_idx, chunk_size;
-	unsigned long long start;
-	char dummy;
+	struct destripe_idx_set idx_set;
+	sector_t member_len, source_start;
+	uint32_t destripes, chunk_size;
+	unsigned int nr_devs, i;
+	unsigned long features;
+	const char *geom_err;
 	int r;
 
 
@@ -334,50 +644,80 @@ static int destripe_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		return -EINVAL;
 	}
 
-	if (kstrtouint(argv[0], 10, &destripes) ||
-		destripes < 2 || destripes > 16 ) {
-		ti->error = "Invalid stripe count (must be 2-16)";
+	if (kstrtouint(argv[0], 10, &destripes)) {
+		ti->error = "Invalid stripe count (must be 2-64)";
 		return -EINVAL;
 	}
 
-	if (kstrtouint(argv[1], 10, &destripe_idx) ||
-		destripe_idx >= destripes) {
-		ti->error = "Invalid stripe index (must be 0 - stripes-1)";
+	if (kstrtouint(argv[2], 10, &chunk_size) || !chunk_size) {
+		ti->error = "Invalid chunk_size";
 		return -EINVAL;
 	}
 
-	if (kstrtouint(argv[2], 10, &chunk_size) || !chunk_size) {
-		ti->error = "Invalid chunk_size";
+	if ((geom_err = destripe_geom_check(destripes, 0, chunk_size))) {
+		ti->error = (char *)geom_err;
 		return -EINVAL;
 	}
 
-	/*
-	 * chunk_size is a power of two
-	 */
-	if (!is_power_of_2(chunk_size) ||
-	    (chunk_size < (PAGE_SIZE >> SECTOR_SHIFT))) {
-		ti->error = "Invalid chunk size";
+	/* <de-stripe index> is a single index, or a set of them: "i,j,..." interleaved
+	 * (re-striped with the same chunk size) or "i+j+..." concatenated */
+	if ((geom_err = destripe_idx_parse(argv[1], destripes, &idx_set)) ||
+	    (geom_err = destripe_geom_check_len(&idx_set, chunk_size, ti->len))) {
+		ti->error = (char *)geom_err;
+		return -EINVAL;
+	}
+
+	/* <#devs> destination devices (2 dev args each), features are optional */
+	if (argc < 4) {
+		ti->error = "Destripe needs 3 arguments and the destination devices specified";
 		return -EINVAL;
 	}
 
-	width = ti->len;
-	if (sector_div(width, chunk_size)) {
-		ti->error = "Target length not divisible by chunk size";
+	if (kstrtouint(argv[3], 10, &nr_devs) || !nr_devs || nr_devs > DESTRIPE_MAX_DEVS) {
+		ti->error = "Invalid number of destination devices";
 		return -EINVAL;
 	}
 
-	/* We only need 1 output dev for destripe (2 dev args, 1 no of devs) */
-	if (argc != 6) {
-		ti->error = "Destripe needs 3 arguments and 1 destination device specified";
+	if (argc < 4 + 2 * nr_devs) {
+		ti->error = "Destripe needs 3 arguments and <#devs> destination devices specified";
 		return -EINVAL;
 	}
 
-	/* set maximum size of I/O submitted to a target to chunk (more will be split) */
+	r = destripe_parse_features(ti, argc - 4 - 2 * nr_devs, argv + 4 + 2 * nr_devs, &features);
+	if (r)
+		return r;
+
+	/* no immutable biovecs (bio_clone_fast) for per-chunk clones on this kernel */
+	if (test_bit(DSS_FEAT_SPLIT_BIOS, &features)) {
+		ti->error = "split_bios feature not supported on this kernel";
+		return -EINVAL;
+	}
+
+	/* prefetch & cache serve reads from the target's chunk cache (see the 3.13 module) */
+	if (test_bit(DSS_FEAT_PREFETCH, &features)) {
+		ti->error = "prefetch feature not supported on this kernel";
+		return -EINVAL;
+	}
+	if (test_bit(DSS_FEAT_CACHE, &features)) {
+		ti->error = "cache feature not supported on this kernel";
+		return -EINVAL;
+	}
+	if (test_bit(DSS_FEAT_ROW_READS, &features)) {
+		ti->error = "row_reads feature not supported on this kernel";
+		return -EINVAL;
+	}
+	if (test_bit(DSS_FEAT_WRITE_BACK, &features)) {
+		ti->error = "write_back feature not supported on this kernel";
+		return -EINVAL;
+	}
+
+	/* set maximum size of I/O submitted to a target to chunk (more will be split),
+	 * dm core also splits at non power of 2 chunk boundaries */
 	r = dm_set_target_max_io_len(ti, chunk_size);
 	if (r)
 		return r;
 
-	if ( !(dss = alloc_ds_context()) ) {
+	if ( !(dss = alloc_ds_context(nr_devs)) ) {
 		ti->error = "Memory allocation for destripe context failed";
 		return -ENOMEM;
 	}
@@ -399,79 +739,78 @@ static int destripe_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 
 	/* Set pointer to dm target; used in trigger_event */
 	dss->ti = ti;
-	dss->destripes = destripes;
-	dss->destripe_idx = destripe_idx;
-	dss->physical_size = ti->len * dss->destripes;
+	dss->nr_devs = nr_devs;
+	dss->features = features;
+	/* each member index is destriped from the same number of chunks (rows) */
+	member_len = ti->len;
+	sector_div(member_len, idx_set.nr);
+	destripe_geom_init_set(&dss->geom, destripes, &idx_set, chunk_size, member_len);
+	destripe_idx_print(&idx_set, dss->idx_spec, sizeof(dss->idx_spec));
+	dss->physical_size = member_len * dss->geom.destripes;
 
 	/* check out include/linux/device-mapper.h for tuning more settings... */
-	ti->num_flush_requests = 1;
+	ti->num_flush_requests = nr_devs;
 	ti->num_discard_requests = 1;
+	ti->split_discard_requests = true;
+	/* WRITE SAME is also how blkdev_issue_zeroout() offloads zeroing (ZERO_PAGE
+	 * payload) on this kernel, there is no write zeroes op yet */
 	ti->num_write_same_requests = 1;
+	ti->per_bio_data_size = sizeof(struct destripe_io);
 
-	dss->chunk_size = chunk_size;
-	if (chunk_size & (chunk_size - 1))
-		dss->chunk_size_shift = -1;
-	else
-		dss->chunk_size_shift = __ffs(chunk_size);
+	dss->err_threshold = DM_IO_ERROR_THRESHOLD;
+	memset(&dss->stats_base, 0, sizeof(dss->stats_base));
 
-	/*
-	 * Get the destination device by parsing the <dev> <sector> pair
-	 */
-	argv += 4;
-
-	if (sscanf(argv[1], "%llu%c", &start, &dummy) != 1) {
-		ti->error = "Couldn't parse destripe destination device";
+	/* IO counters, zeroed by alloc_percpu() */
+	dss->stats = alloc_percpu(struct destripe_stats);
+	if (!dss->stats) {
+		ti->error = "Memory allocation for destripe statistics failed";
 		kfree(dss);
-		return -EINVAL;
+		return -ENOMEM;
 	}
 
-	if (dm_get_device(ti, argv[0],
-			dm_table_get_mode(ti->table), &dss->destripe[0].dev)) {
-		ti->error = "Invalid destripe destination device";
-		//dm_put_device(ti, dss->destripe[0].dev);
-		kfree(dss);
-		return -ENXIO;
-	}
+	/*
+	 * Get the destination devices by parsing the <dev> <sector> pairs: the striped
+	 * source is their concatenation, each from its offset up to its end.
+	 */
+	argv += 4;
 
-	/* check the output device size... it should be at least destripes * ti->len,
-	 * else we cannot support the required de-striping ! */
-	r = ioctl_by_bdev( dss->destripe[0].dev->bdev, BLKGETSIZE, (sector_t) &dss->destripe[0].physical_secs );
-	if (r) {
-		ti->error = "Error reading physical device size via BLKGETSIZE ioctl()";
-fail_ctr_invalid:
-		kfree(dss);
-		return -EINVAL;
+	for (i = 0, source_start = 0; i < nr_devs; i++) {
+		r = destripe_get_dev(ti, dss, i, argv + 2 * i, source_start);
+		if (r)
+			goto fail_ctr_devs;
+		source_start += dss->destripe[i].source_secs;
 	}
 
 	/* target length must be at least destripes * ti->len to support target address space... */
-	if (dss->destripe[0].physical_secs < dss->physical_size ) {
+	if (source_start < dss->physical_size) {
 		ti->error = "Physical device capacity not enough to support destripes on requested target length";
-		goto fail_ctr_invalid;
+		r = -EINVAL;
+		goto fail_ctr_devs;
 	}
 
-	if (dss->destripe[0].physical_secs > dss->physical_size )
+	if (source_start > dss->physical_size) {
 		DMWARN("[%s] WARNING: Larger physical space than required! DeStripe using only %lu of %lu sectors.",
 				dss->name, (unsigned long) dss->physical_size,
-				(unsigned long) dss->destripe[0].physical_secs );
-
-	dss->destripe[0].physical_start = start;
-
-	atomic_set(&(dss->destripe[0].error_count), 0);
-
-	/* initialize IO counters... */
-	atomic_set( &dss->read_ios_total, 0 );
-	atomic_set( &dss->read_ios_pending, 0 );
-	atomic_set( &dss->write_ios_total, 0 );
-	atomic_set( &dss->write_ios_pending, 0 );
+				(unsigned long) source_start );
+		dss->destripe[nr_devs - 1].source_secs -= source_start - dss->physical_size;
+	}
 
 	ti->private = dss;
 
-	DMINFO("Device %s INIT OK: len=%lu destripes=%u idx:%u phys_size=%lu "
-	   		"chunk_size=%u ck_sz_shift=%d",
-			dss->name, ti->len, dss->destripes, dss->destripe_idx,
-			(unsigned long)dss->physical_size, dss->chunk_size, dss->chunk_size_shift);
+	DMINFO("Device %s INIT OK: len=%lu destripes=%u idx:%s phys_size=%lu "
+	   		"chunk_size=%u ck_sz_shift=%d map=%s devs=%u",
+			dss->name, ti->len, dss->geom.destripes, dss->idx_spec,
+			(unsigned long)dss->physical_size, dss->geom.chunk_size, dss->geom.chunk_size_shift,
+			destripe_map_class_name(&dss->geom), dss->nr_devs);
 
 	return 0;
+
+fail_ctr_devs:
+	while (i--)
+		dm_put_device(ti, dss->destripe[i].dev);
+	free_percpu(dss->stats);
+	kfree(dss);
+	return r;
 }
 
 /*----------------------------------------------------------------- */
@@ -479,13 +818,16 @@ fail_ctr_invalid:
 static void destripe_dtr(struct dm_target *ti)
 {
 	struct destripe_set *dss = (struct destripe_set *) ti->private;
+	unsigned int i;
 
 	DRSDEBUG_CALL("destripe_dtr called...\n");
 	DMWARN("[%s] DeStripe Device EXIT.", dss->name);
 
-	dm_put_device(ti, dss->destripe[0].dev);
+	for (i = 0; i < dss->nr_devs; i++)
+		dm_put_device(ti, dss->destripe[i].dev);
 
 	flush_work(&dss->trigger_event);
+	free_percpu(dss->stats);
 	kfree(dss);
 }
 
@@ -493,11 +835,16 @@ static int destripe_iterate_devices(struct dm_target *ti,
 				  iterate_devices_callout_fn fn, void *data)
 {
 	struct destripe_set *dss = (struct destripe_set *) ti->private;
+	unsigned int i;
+	int r = 0;
 
 	DRSDEBUG_CALL("destripe_iterate_devices called...\n");
 
-	/* we only have 1 device, so no iteration... */
-	return fn(ti, dss->destripe[0].dev, dss->destripe[0].physical_start, ti->len, data);
+	for (i = 0; i < dss->nr_devs && !r; i++)
+		r = fn(ti, dss->destripe[i].dev, dss->destripe[i].physical_start,
+			dss->destripe[i].source_secs, data);
+
+	return r;
 }
 
 /*----------------------------------------------------------------- */
@@ -506,10 +853,33 @@ static void destripe_io_hints(struct dm_target *ti,
 			    struct queue_limits *limits)
 {
 	struct destripe_set *dss = ti->private;
-	unsigned chunk_size = dss->chunk_size << SECTOR_SHIFT;
+	unsigned chunk_size = dss->geom.chunk_size << SECTOR_SHIFT;
+	unsigned width = dss->geom.idx.layout == DESTRIPE_LAYOUT_INTERLEAVED ? dss->geom.idx.nr : 1;
+	unsigned int i;
+	sector_t start;
+	bool aligned;
 
+	/* physical block size & the other device limits are stacked by dm core */
+
+	/* io_opt: a full row of interleaved indices (mkfs reads it as the stripe width) */
 	blk_limits_io_min(limits, chunk_size);
-	blk_limits_io_opt(limits, chunk_size);
+	blk_limits_io_opt(limits, chunk_size * width);
+
+	/* an I/O of max_sectors from a chunk boundary ends on one */
+	if (limits->max_sectors > dss->geom.chunk_size)
+		limits->max_sectors = rounddown(limits->max_sectors, dss->geom.chunk_size);
+
+	/* discards are split per chunk: granules must not straddle chunks */
+	if (!limits->max_discard_sectors)
+		return;
+	aligned = limits->discard_granularity && !(chunk_size % limits->discard_granularity);
+	for (i = 0; aligned && i < dss->nr_devs; i++) {
+		start = dss->destripe[i].physical_start << SECTOR_SHIFT;
+		aligned = !sector_div(start, limits->discard_granularity);
+	}
+	if (!aligned)
+		limits->discard_granularity = chunk_size;
+	limits->discard_alignment = 0;
 }
 
 /*----------------------------------------------------------------- */
@@ -520,15 +890,16 @@ static int destripe_merge(struct dm_target *ti, struct bvec_merge_data *bvm,
 	struct destripe_set *dss = ti->private;
 	sector_t bvm_sector = bvm->bi_sector;
 	struct request_queue *q;
+	struct destripe *d;
 
-	destripe_map_sector(dss, bvm_sector, &bvm_sector);
+	d = destripe_map_sector(dss, bvm_sector, &bvm_sector);
 
-	q = bdev_get_queue(dss->destripe[0].dev->bdev);
+	q = bdev_get_queue(d->dev->bdev);
 	if (!q->merge_bvec_fn)
 		return max_size;
 
-	bvm->bi_bdev = dss->destripe[0].dev->bdev;
-	bvm->bi_sector = dss->destripe[0].physical_start + bvm_sector;
+	bvm->bi_bdev = d->dev->bdev;
+	bvm->bi_sector = bvm_sector;
 
 	return min(max_size, q->merge_bvec_fn(q, bvm, biovec));
 }
@@ -0,0 +1,2962 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) driver.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ * 
+ * The dm-destripe driver is free software: you can redistribute 
+ * it and/or modify it under the terms of the GNU General Public 
+ * License as published by the Free Software Foundation, either 
+ * version 2 of the License, or (at your option) any later version.
+ * 
+ * Some open source application is distributed in the hope that it will 
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty 
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Include some original dm header files */
+#include <linux/device-mapper.h>
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+
+#include <linux/types.h>
+#include <linux/ctype.h>
+#include <linux/mempool.h>
+#include <linux/time.h>
+#include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/highmem.h>
+#include <linux/hash.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+#include <linux/list_sort.h>
+#include <linux/dax.h>
+#include <linux/uio.h>
+
+#include "dm-destripe-map.h"	/* Shared destripe mapping core */
+#include "dm-destripe.h"		/* Local destripe header file */
+
+#define DM_MSG_PREFIX "destripe"
+#define DM_IO_ERROR_THRESHOLD 15
+
+/* I/O type names, indexed by enum destripe_io_type */
+static const char *destripe_io_type_names[DSS_IO_MAX] = {
+	[DSS_IO_READ] = "read",
+	[DSS_IO_WRITE] = "write",
+	[DSS_IO_DISCARD] = "discard",
+	[DSS_IO_FLUSH] = "flush",
+};
+
+/* Table feature arg names, indexed by enum destripe_feature */
+static const char *destripe_feature_names[DSS_FEAT_MAX] = {
+	[DSS_FEAT_SPLIT_BIOS] = "split_bios",
+	[DSS_FEAT_PREFETCH] = "prefetch",
+	[DSS_FEAT_CACHE] = "cache",
+	[DSS_FEAT_ROW_READS] = "row_reads",
+	[DSS_FEAT_WRITE_BACK] = "write_back",
+};
+
+/* Bioset for the per-chunk clones of split bios, shared by all targets */
+static struct bio_set destripe_bs;
+
+/* Completion of the prefetch reads (prefetch feature), shared by all targets */
+static struct workqueue_struct *destripe_wq;
+
+
+/* Backing device holding source sector phys: binary search of the device starts */
+static inline struct destripe *destripe_map_dev(struct destripe_set *dss, sector_t phys)
+{
+	unsigned int lo = 0, hi = dss->nr_devs - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) >> 1;
+		if (dss->destripe[mid].source_start <= phys)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &dss->destripe[lo];
+}
+
+/* Map a target sector to its backing device & the sector on that device */
+static inline struct destripe *destripe_map_sector(struct destripe_set *dss,
+					sector_t sector, sector_t *mapped_sec)
+{
+	sector_t offset = dm_target_offset(dss->ti, sector);
+	sector_t phys = destripe_geom_map(&dss->geom, offset);
+	struct destripe *d = destripe_map_dev(dss, phys);
+
+	DRSDEBUG("destripe_map_sector() ENTER  sector= %lu, offset= %lu \n",
+				(unsigned long)sector, (unsigned long)offset );
+
+	*mapped_sec = phys - d->source_start + d->physical_start;
+
+	DRSDEBUG("destripe_map_sector() END    map_sec= %lu\n", (unsigned long)*mapped_sec );
+	return d;
+}
+
+/*----------------------------------------------------------------- */
+
+/*
+ * I/O statistics: per-CPU 64-bit counters, so that the map & end_io paths
+ * never share a cache line between cores. Folded by destripe_status().
+ */
+static inline int destripe_io_type(struct bio *bio)
+{
+	if (bio->bi_opf & REQ_PREFLUSH)
+		return DSS_IO_FLUSH;
+	if (bio_op(bio) == REQ_OP_DISCARD)
+		return DSS_IO_DISCARD;
+	return bio_data_dir(bio) == WRITE ? DSS_IO_WRITE : DSS_IO_READ;
+}
+
+static inline void destripe_account(struct destripe_set *dss, int type, unsigned int bytes)
+{
+	this_cpu_inc(dss->stats->cnt.ios[type]);
+	this_cpu_add(dss->stats->cnt.bytes[type], bytes);
+}
+
+/* Completion of a bio mapped at start: latency goes to bucket log2(usecs) */
+static inline void destripe_account_done(struct destripe_set *dss, struct bio *bio,
+					ktime_t start)
+{
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+	int type = destripe_io_type(bio);
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	if (bucket >= DESTRIPE_LAT_BUCKETS)
+		bucket = DESTRIPE_LAT_BUCKETS - 1;
+
+	this_cpu_inc(dss->stats->cnt.done[type]);
+	this_cpu_inc(dss->stats->lat[type][bucket]);
+}
+
+static void destripe_stats_fold(struct destripe_set *dss, struct destripe_counters *sum)
+{
+	struct destripe_counters *cnt;
+	int cpu, type;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		cnt = &per_cpu_ptr(dss->stats, cpu)->cnt;
+		for (type = 0; type < DSS_IO_MAX; type++) {
+			sum->ios[type] += cnt->ios[type];
+			sum->done[type] += cnt->done[type];
+			sum->bytes[type] += cnt->bytes[type];
+		}
+	}
+}
+
+/* Latency histogram of one I/O type, folded over the CPUs */
+static void destripe_stats_fold_latency(struct destripe_set *dss, int type, u64 *hist)
+{
+	int cpu, b;
+
+	memset(hist, 0, sizeof(u64) * DESTRIPE_LAT_BUCKETS);
+	for_each_possible_cpu(cpu)
+		for (b = 0; b < DESTRIPE_LAT_BUCKETS; b++)
+			hist[b] += per_cpu_ptr(dss->stats, cpu)->lat[type][b];
+}
+
+/*
+ * Latency (usecs) below which permille/1000 of the I/Os of a folded histogram
+ * fall: the upper bound of the bucket holding that rank.
+ */
+static u64 destripe_latency_percentile(const u64 *hist, unsigned int permille)
+{
+	u64 total = 0, acc = 0;
+	int b;
+
+	for (b = 0; b < DESTRIPE_LAT_BUCKETS; b++)
+		total += hist[b];
+	if (!total)
+		return 0;
+
+	for (b = 0; b < DESTRIPE_LAT_BUCKETS - 1; b++) {
+		acc += hist[b];
+		if (acc * 1000 >= total * permille)
+			break;
+	}
+	return (1ULL << b) - 1;
+}
+
+/*
+ * reset_stats message: the current totals become the base that status
+ * subtracts, so that the per-CPU counters are never written but by their CPU
+ * and the outstanding counts stay right across a reset.
+ */
+static void destripe_stats_reset(struct destripe_set *dss)
+{
+	int type;
+
+	destripe_stats_fold(dss, &dss->stats_base.cnt);
+	for (type = 0; type < DSS_IO_MAX; type++)
+		destripe_stats_fold_latency(dss, type, dss->stats_base.lat[type]);
+}
+
+/* Folded counters since the last reset */
+static void destripe_stats_rebase(struct destripe_set *dss, struct destripe_counters *sum)
+{
+	struct destripe_counters *base = &dss->stats_base.cnt;
+	int type;
+
+	for (type = 0; type < DSS_IO_MAX; type++) {
+		sum->ios[type] -= base->ios[type];
+		sum->done[type] -= base->done[type];
+		sum->bytes[type] -= base->bytes[type];
+	}
+}
+
+/* Outstanding I/Os of a type, from folded stats (not a snapshot: may be off by a few) */
+static inline u64 destripe_stats_pending(struct destripe_counters *sum, int type)
+{
+	return sum->ios[type] > sum->done[type] ? sum->ios[type] - sum->done[type] : 0;
+}
+
+/* Complete a bio with a block status (0: success) */
+static inline void destripe_bio_endio(struct bio *bio, blk_status_t status)
+{
+	bio->bi_status = status;
+	bio_endio(bio);
+}
+
+/* Ops mapped as a sector range, without data to split on page boundaries */
+static inline bool destripe_range_op(struct bio *bio)
+{
+	switch (bio_op(bio)) {
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_SAME:
+	case REQ_OP_WRITE_ZEROES:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Clone for a piece of the bio. REQ_NOWAIT bios do not wait on the mempool:
+ * NULL then, the bio is bounced with BLK_STS_AGAIN and resubmitted by its
+ * submitter from a context that may block.
+ */
+static inline struct bio *destripe_clone(struct bio *bio)
+{
+	if (bio->bi_opf & REQ_NOWAIT)
+		return bio_clone_fast(bio, GFP_NOWAIT | __GFP_NOWARN, &destripe_bs);
+
+	/* never fails: mempool backed, the clones sent get rescued */
+	return bio_clone_fast(bio, GFP_NOIO, &destripe_bs);
+}
+
+/*----------------------------------------------------------------- */
+
+/*
+ * split_bios: a bio spanning several chunks is split here into per-chunk
+ * clones, instead of dm core cloning, mapping and completing every chunk
+ * separately. The clones share the bvecs of the bio (bio_clone_fast) and
+ * the bio is completed once, when its last clone completes.
+ */
+static void destripe_split_endio(struct bio *clone)
+{
+	struct bio *bio = clone->bi_private;
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
+
+	if (unlikely(clone->bi_status))
+		io->error = clone->bi_status;
+	bio_put(clone);
+
+	if (atomic_dec_and_test(&io->pending))
+		destripe_bio_endio(bio, io->error);
+}
+
+/*
+ * A piece cloned: sent at once, as the next clone may wait for the mempool
+ * to get it back (bioset rescuer). A REQ_NOWAIT bio waits for no one, its
+ * pieces are only sent once all of them are cloned, see below.
+ */
+static inline void destripe_clone_add(struct bio *bio, struct bio_list *clones,
+				struct bio *clone)
+{
+	if (bio->bi_opf & REQ_NOWAIT)
+		bio_list_add(clones, clone);
+	else
+		submit_bio_noacct(clone);
+}
+
+/*
+ * Without a clone for every piece (REQ_NOWAIT), none is sent: the bio goes
+ * back with BLK_STS_AGAIN untouched, not with part of a write done.
+ */
+static int destripe_clones_submit(struct bio *bio, struct bio_list *clones, bool complete)
+{
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
+	struct bio *clone;
+
+	if (unlikely(!complete)) {
+		while ((clone = bio_list_pop(clones)))
+			bio_put(clone);
+		destripe_bio_endio(bio, BLK_STS_AGAIN);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	/* NOTE: we run under submit_bio_noacct(), so the clones are queued on
+	 *       current->bio_list and reach the backing queue back to back (within
+	 *       the submitter's plug) as soon as we return. */
+	while ((clone = bio_list_pop(clones)))
+		submit_bio_noacct(clone);
+
+	if (atomic_dec_and_test(&io->pending))
+		destripe_bio_endio(bio, io->error);
+	return DM_MAPIO_SUBMITTED;
+}
+
+static int destripe_map_split(struct destripe_set *dss, struct bio *bio)
+{
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
+	sector_t sector = bio->bi_iter.bi_sector;
+	sector_t offset = dm_target_offset(dss->ti, sector);
+	unsigned int sectors = bio_sectors(bio), done = 0, len;
+	struct bio_list clones;
+	struct bio *clone;
+
+	atomic_set(&io->pending, 1);
+	io->error = 0;
+	bio_list_init(&clones);
+
+	while (done < sectors) {
+		len = min_t(unsigned int, sectors - done,
+				destripe_geom_chunk_left(&dss->geom, offset + done));
+
+		clone = destripe_clone(bio);
+		if (unlikely(!clone))
+			break;
+		bio_advance(clone, to_bytes(done));
+		clone->bi_iter.bi_size = to_bytes(len);
+		bio_set_dev(clone, destripe_map_sector(dss, sector + done,
+						&clone->bi_iter.bi_sector)->dev->bdev);
+		clone->bi_end_io = destripe_split_endio;
+		clone->bi_private = bio;
+
+		/* for the error accounting in destripe_end_io(): the first piece's device */
+		if (!done)
+			bio_set_dev(bio, clone->bi_bdev);
+
+		atomic_inc(&io->pending);
+		destripe_clone_add(bio, &clones, clone);
+		done += len;
+	}
+
+	return destripe_clones_submit(bio, &clones, done == sectors);
+}
+
+/*----------------------------------------------------------------- */
+
+/*
+ * Discards, WRITE SAME & WRITE ZEROES: dm core cuts them only at the target
+ * boundary, but each chunk of the target maps to its own extent of the striped
+ * source. One clone per extent, extents adjacent on the same device merged
+ * (interleaved member indices), submitted back to back and completing the bio
+ * once, as destripe_map_split().
+ */
+static bool destripe_range_clone(struct destripe_set *dss, struct bio *bio,
+				struct destripe *d, sector_t begin, sector_t end,
+				struct bio_list *clones)
+{
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
+	struct bio *clone;
+
+	clone = destripe_clone(bio);
+	if (unlikely(!clone))
+		return false;
+	bio_set_dev(clone, d->dev->bdev);
+	clone->bi_iter.bi_sector = begin - d->source_start + d->physical_start;
+	clone->bi_iter.bi_size = to_bytes(end - begin);
+	clone->bi_end_io = destripe_split_endio;
+	clone->bi_private = bio;
+
+	atomic_inc(&io->pending);
+	destripe_clone_add(bio, clones, clone);
+	return true;
+}
+
+static int destripe_map_range(struct destripe_set *dss, struct bio *bio)
+{
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
+	sector_t offset = dm_target_offset(dss->ti, bio->bi_iter.bi_sector);
+	unsigned int sectors = bio_sectors(bio), done = 0, len;
+	sector_t phys, begin = 0, end = 0;
+	struct destripe *d = NULL, *pd;
+	struct bio_list clones;
+
+	/* within a chunk: remapped as is */
+	if (sectors <= destripe_geom_chunk_left(&dss->geom, offset)) {
+		bio_set_dev(bio, destripe_map_sector(dss, bio->bi_iter.bi_sector,
+						&bio->bi_iter.bi_sector)->dev->bdev);
+		return DM_MAPIO_REMAPPED;
+	}
+
+	atomic_set(&io->pending, 1);
+	io->error = 0;
+	bio_list_init(&clones);
+
+	while (done < sectors) {
+		len = min_t(unsigned int, sectors - done,
+				destripe_geom_chunk_left(&dss->geom, offset + done));
+		phys = destripe_geom_map(&dss->geom, offset + done);
+		pd = destripe_map_dev(dss, phys);
+		if (pd == d && phys == end)
+			end += len;
+		else {
+			if (d && !destripe_range_clone(dss, bio, d, begin, end, &clones))
+				break;
+			if (!d)	/* for the error accounting in destripe_end_io() */
+				bio_set_dev(bio, pd->dev->bdev);
+			d = pd;
+			begin = phys;
+			end = phys + len;
+		}
+		done += len;
+	}
+
+	return destripe_clones_submit(bio, &clones, done == sectors &&
+				destripe_range_clone(dss, bio, d, begin, end, &clones));
+}
+
+/*----------------------------------------------------------------- */
+
+/*
+ * Chunk cache: chunks of the striped source held in memory, keyed by their
+ * source sector, for the cache & prefetch features. The reads of the target
+ * fill the chunks page by page (cache), the prefetch reads them in whole.
+ * Admission is 2Q, so that a scan (a backup sweep, a prefetched stream) goes
+ * through A1in without flushing the re-read chunks of Am:
+ *   - a new chunk is queued on the A1in FIFO, or on the Am LRU if its key is
+ *     on the A1out ghost list (evicted from A1in, or written, lately);
+ *   - A1in is evicted first while it holds more than 1/4 of the cache.
+ * Memory is charged in pages, 1 per chunk + the pages it holds, bounded by
+ * cache_max_pages and the shrinker. Writes drop the chunks they touch.
+ */
+
+/* Sector offset of a target offset within its chunk */
+static inline unsigned int destripe_in_chunk(struct destripe_set *dss, sector_t offset)
+{
+	return dss->geom.chunk_size - destripe_geom_chunk_left(&dss->geom, offset);
+}
+
+static inline unsigned int destripe_chunk_pages(struct destripe_set *dss)
+{
+	return dss->geom.chunk_size >> (PAGE_SHIFT - SECTOR_SHIFT);
+}
+
+static void destripe_chunk_put(struct destripe_chunk *c)
+{
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&c->ref))
+		return;
+
+	for (i = 0; i < c->nr_pages; i++)
+		if (c->pages[i])
+			__free_page(c->pages[i]);
+	kfree(c);
+}
+
+/* A chunk, with all its pages for a whole read (or none). NULL if memory is short:
+ * the cache never waits for memory */
+static struct destripe_chunk *destripe_chunk_alloc(struct destripe_set *dss,
+					sector_t offset, sector_t key, bool whole)
+{
+	unsigned int nr_pages = destripe_chunk_pages(dss), i;
+	struct destripe_chunk *c;
+
+	c = kzalloc(sizeof(*c) + nr_pages * sizeof(struct page *) +
+			BITS_TO_LONGS(nr_pages) * sizeof(unsigned long), GFP_NOWAIT | __GFP_NOWARN);
+	if (!c)
+		return NULL;
+
+	atomic_set(&c->ref, 1);
+	c->nr_pages = nr_pages;
+	c->valid = (unsigned long *)(c->pages + nr_pages);
+	for (i = 0; whole && i < nr_pages; i++) {
+		c->pages[i] = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+		if (!c->pages[i]) {
+			destripe_chunk_put(c);
+			return NULL;
+		}
+	}
+	c->nr_held = whole ? nr_pages : 0;
+
+	INIT_HLIST_NODE(&c->hash);
+	INIT_LIST_HEAD(&c->lru);
+	c->key = key;
+	c->offset = offset;
+	atomic_set(&c->io_pending, 1);
+	bio_list_init(&c->waiters);
+	c->dss = dss;
+	return c;
+}
+
+/*
+ * Copy between the data of a bio (from iter) and the pages of a chunk (cached
+ * or write-back buffer), the bio lying at byte pos of the chunk. Pages not held
+ * are skipped.
+ */
+static void destripe_chunk_copy(struct page **pages, struct bio *bio,
+				struct bvec_iter iter, unsigned long pos, bool fill)
+{
+	unsigned int done, len;
+	struct bvec_iter it;
+	struct bio_vec bv;
+	struct page *page;
+	char *data, *buf;
+
+	/* single page segments, even from multi-page bvecs */
+	__bio_for_each_segment(bv, bio, it, iter) {
+		data = kmap_local_page(bv.bv_page);
+		for (done = 0; done < bv.bv_len; done += len, pos += len) {
+			len = min_t(unsigned int, bv.bv_len - done, PAGE_SIZE - offset_in_page(pos));
+			page = READ_ONCE(pages[pos >> PAGE_SHIFT]);
+			if (!page)
+				continue;
+			buf = kmap_local_page(page);
+			if (fill)
+				memcpy(buf + offset_in_page(pos), data + bv.bv_offset + done, len);
+			else
+				memcpy(data + bv.bv_offset + done, buf + offset_in_page(pos), len);
+			kunmap_local(buf);
+		}
+		kunmap_local(data);
+		if (!fill)
+			flush_dcache_page(bv.bv_page);
+	}
+}
+
+/* Called with cache_lock held: are sectors from in_chunk all in valid pages? */
+static inline bool destripe_chunk_holds(struct destripe_chunk *c, unsigned int in_chunk,
+				unsigned int sectors)
+{
+	unsigned int first = in_chunk >> (PAGE_SHIFT - SECTOR_SHIFT);
+	unsigned int last = (in_chunk + sectors - 1) >> (PAGE_SHIFT - SECTOR_SHIFT);
+
+	return find_next_zero_bit(c->valid, last + 1, first) > last;
+}
+
+/* Called with cache_lock held */
+static struct destripe_chunk *destripe_cache_lookup(struct destripe_set *dss, sector_t key)
+{
+	struct destripe_chunk *c;
+
+	hlist_for_each_entry(c, &dss->cache_hash[hash_64(key, dss->cache_hash_bits)], hash)
+		if (c->key == key)
+			return c;
+	return NULL;
+}
+
+/* Called with cache_lock held: a chunk evicted from A1in (or written) lately */
+static void destripe_ghost_add(struct destripe_set *dss, sector_t key)
+{
+	struct destripe_ghost *g;
+
+	if (dss->cache_nr_ghosts >= dss->cache_max_ghosts) {
+		g = list_entry(dss->cache_a1out.prev, struct destripe_ghost, list);
+		hlist_del(&g->hash);
+		list_del(&g->list);
+		dss->cache_nr_ghosts--;
+	} else {
+		g = kmalloc(sizeof(*g), GFP_ATOMIC | __GFP_NOWARN);
+		if (!g)
+			return;
+	}
+
+	g->key = key;
+	hlist_add_head(&g->hash, &dss->ghost_hash[hash_64(key, dss->cache_hash_bits)]);
+	list_add(&g->list, &dss->cache_a1out);
+	dss->cache_nr_ghosts++;
+}
+
+/* Called with cache_lock held: if key is on A1out, forget it & return true */
+static bool destripe_ghost_take(struct destripe_set *dss, sector_t key)
+{
+	struct destripe_ghost *g;
+
+	hlist_for_each_entry(g, &dss->ghost_hash[hash_64(key, dss->cache_hash_bits)], hash)
+		if (g->key == key) {
+			hlist_del(&g->hash);
+			list_del(&g->list);
+			kfree(g);
+			dss->cache_nr_ghosts--;
+			return true;
+		}
+	return false;
+}
+
+/* Called with cache_lock held: (un)charge pages to the cache & the chunk's queue */
+static inline void destripe_cache_charge(struct destripe_set *dss, struct destripe_chunk *c,
+				int pages)
+{
+	dss->cache_pages += pages;
+	if (!test_bit(DSC_AM, &c->state))
+		dss->cache_a1in_pages += pages;
+}
+
+/* Called with cache_lock held: cache a new chunk, 2Q admission */
+static void destripe_cache_insert(struct destripe_set *dss, struct destripe_chunk *c)
+{
+	if (destripe_ghost_take(dss, c->key)) {
+		set_bit(DSC_AM, &c->state);
+		list_add(&c->lru, &dss->cache_am);
+	} else
+		list_add(&c->lru, &dss->cache_a1in);
+
+	atomic_inc(&c->ref);	/* hashed */
+	hlist_add_head(&c->hash, &dss->cache_hash[hash_64(c->key, dss->cache_hash_bits)]);
+	dss->cache_nr++;
+	destripe_cache_charge(dss, c, 1 + c->nr_held);
+}
+
+/* Called with cache_lock held: drop a chunk, a read in flight still completes its waiters */
+static void destripe_cache_unlink(struct destripe_set *dss, struct destripe_chunk *c)
+{
+	hlist_del_init(&c->hash);
+	list_del_init(&c->lru);
+	dss->cache_nr--;
+	destripe_cache_charge(dss, c, -(1 + c->nr_held));
+	destripe_chunk_put(c);
+}
+
+/*
+ * Called with cache_lock held, for every prefetched chunk that served a read
+ * (hit) or was evicted unused (wasted): the prefetch depth doubles over a
+ * window of at least 75% hits and halves below 50%.
+ */
+static void destripe_ra_adapt(struct destripe_set *dss, bool hit)
+{
+	unsigned int max_depth = min_t(unsigned int, DESTRIPE_RA_MAX_DEPTH, dss->cache_max_chunks);
+
+	if (hit) {
+		dss->ra_hits++;
+		dss->ra_win_hits++;
+	} else {
+		dss->ra_wasted++;
+		dss->ra_win_wasted++;
+	}
+
+	if (dss->ra_win_hits + dss->ra_win_wasted < DESTRIPE_RA_WINDOW)
+		return;
+
+	if (dss->ra_win_wasted * 4 <= DESTRIPE_RA_WINDOW)
+		dss->ra_depth = min(dss->ra_depth * 2, max_depth);
+	else if (dss->ra_win_hits * 2 < DESTRIPE_RA_WINDOW)
+		dss->ra_depth = max(dss->ra_depth / 2, 1U);
+	dss->ra_win_hits = dss->ra_win_wasted = 0;
+}
+
+/* Called with cache_lock held: evict down to max_pages */
+static void destripe_cache_reclaim(struct destripe_set *dss, unsigned int max_pages)
+{
+	struct destripe_chunk *c;
+
+	while (dss->cache_pages > max_pages) {
+		if (!list_empty(&dss->cache_a1in) &&
+		    (dss->cache_a1in_pages > dss->cache_max_pages / 4 || list_empty(&dss->cache_am))) {
+			c = list_entry(dss->cache_a1in.prev, struct destripe_chunk, lru);
+			destripe_ghost_add(dss, c->key);
+		} else if (!list_empty(&dss->cache_am))
+			c = list_entry(dss->cache_am.prev, struct destripe_chunk, lru);
+		else
+			break;
+
+		if (test_bit(DSC_PREFETCHED, &c->state) && !test_bit(DSC_HIT, &c->state))
+			destripe_ra_adapt(dss, false);
+		destripe_cache_unlink(dss, c);
+	}
+}
+
+/* Move the cached chunks & ghosts to new hash tables, under cache_lock */
+static void destripe_cache_rehash(struct destripe_set *dss, struct hlist_head *hash,
+				  unsigned int bits)
+{
+	struct hlist_head *ghost_hash = hash + (1 << bits);
+	struct destripe_chunk *c;
+	struct destripe_ghost *g;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; dss->cache_hash && i < (1U << dss->cache_hash_bits); i++) {
+		hlist_for_each_entry_safe(c, tmp, &dss->cache_hash[i], hash) {
+			hlist_del(&c->hash);
+			hlist_add_head(&c->hash, &hash[hash_64(c->key, bits)]);
+		}
+		hlist_for_each_entry_safe(g, tmp, &dss->ghost_hash[i], hash) {
+			hlist_del(&g->hash);
+			hlist_add_head(&g->hash, &ghost_hash[hash_64(g->key, bits)]);
+		}
+	}
+	dss->cache_hash = hash;
+	dss->ghost_hash = ghost_hash;
+	dss->cache_hash_bits = bits;
+}
+
+/*
+ * Cache size for the enabled features: cache_mb, or just room for the prefetch.
+ * The hash tables follow it, a bucket per chunk, and they cap the cache to
+ * 1 << DESTRIPE_CACHE_HASH_MAX_BITS chunks so the chains walked with the
+ * interrupts off stay short whatever cache_mb.
+ */
+static void destripe_cache_resize(struct destripe_set *dss)
+{
+	unsigned int mb = test_bit(DSS_FEAT_CACHE, &dss->features) ? dss->cache_mb :
+								   DESTRIPE_RA_MAX_MB;
+	unsigned int chunk_charge = 1 + destripe_chunk_pages(dss);
+	unsigned int max_pages = max(mb << (20 - PAGE_SHIFT), chunk_charge);
+	unsigned int max_chunks = min(max_pages / chunk_charge, 1U << DESTRIPE_CACHE_HASH_MAX_BITS);
+	unsigned int bits = clamp_t(unsigned int, order_base_2(max_chunks),
+				    DESTRIPE_RA_HASH_BITS, DESTRIPE_CACHE_HASH_MAX_BITS);
+	struct hlist_head *hash = NULL, *old = NULL;
+	struct destripe_ghost *g;
+	unsigned long flags;
+
+	/* without memory for new tables keep the old ones & fit the cache to them */
+	if (bits != dss->cache_hash_bits) {
+		hash = kvcalloc(2UL << bits, sizeof(struct hlist_head), GFP_KERNEL);
+		if (!hash)
+			max_chunks = min(max_chunks, 1U << dss->cache_hash_bits);
+	}
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	if (hash) {
+		old = dss->cache_hash;
+		destripe_cache_rehash(dss, hash, bits);
+	}
+	dss->cache_max_pages = min(max_pages, max_chunks * chunk_charge);
+	dss->cache_max_chunks = max_chunks;
+	dss->cache_max_ghosts = max(dss->cache_max_chunks / 2, 16U);
+	dss->ra_depth = min(dss->ra_depth, dss->cache_max_chunks);
+
+	destripe_cache_reclaim(dss, dss->cache_max_pages);
+	while (dss->cache_nr_ghosts > dss->cache_max_ghosts) {
+		g = list_entry(dss->cache_a1out.prev, struct destripe_ghost, list);
+		hlist_del(&g->hash);
+		list_del(&g->list);
+		kfree(g);
+		dss->cache_nr_ghosts--;
+	}
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+	kvfree(old);
+}
+
+static unsigned long destripe_cache_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct destripe_set *dss = container_of(shrink, struct destripe_set, cache_shrinker);
+
+	return READ_ONCE(dss->cache_pages);
+}
+
+static unsigned long destripe_cache_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct destripe_set *dss = container_of(shrink, struct destripe_set, cache_shrinker);
+	unsigned long flags, freed;
+	unsigned int before;
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	before = dss->cache_pages;
+	destripe_cache_reclaim(dss, before > sc->nr_to_scan ? before - sc->nr_to_scan : 0);
+	freed = before - dss->cache_pages;
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+
+	return freed;
+}
+
+static int destripe_cache_init(struct destripe_set *dss)
+{
+	dss->cache_hash = dss->ghost_hash = NULL;
+	dss->cache_hash_bits = 0;
+	spin_lock_init(&dss->cache_lock);
+	INIT_LIST_HEAD(&dss->cache_a1in);
+	INIT_LIST_HEAD(&dss->cache_am);
+	INIT_LIST_HEAD(&dss->cache_a1out);
+	dss->cache_nr = dss->cache_pages = dss->cache_a1in_pages = dss->cache_nr_ghosts = 0;
+	dss->cache_mb = DESTRIPE_CACHE_MB;
+	dss->cache_hits = dss->cache_misses = 0;
+
+	memset(dss->ra_streams, 0, sizeof(dss->ra_streams));
+	dss->ra_depth = DESTRIPE_RA_INIT_DEPTH;
+	dss->ra_win_hits = dss->ra_win_wasted = 0;
+	dss->ra_issued = dss->ra_hits = dss->ra_wasted = 0;
+	dss->row_reads = dss->row_handed = 0;
+	atomic_set(&dss->ra_inflight, 0);
+	init_waitqueue_head(&dss->ra_wait);
+
+	/* sizes the hash tables too */
+	destripe_cache_resize(dss);
+	if (!dss->cache_hash)
+		return -ENOMEM;
+
+	dss->cache_shrinker.count_objects = destripe_cache_count;
+	dss->cache_shrinker.scan_objects = destripe_cache_scan;
+	dss->cache_shrinker.seeks = DEFAULT_SEEKS;
+	dss->cache_shrinker.batch = 0;
+	return 0;
+}
+
+/*
+ * Read completion with the cache: keep the whole pages the bio read, if the
+ * chunk is still cached (a write since its map drops it).
+ */
+static void destripe_cache_fill(struct destripe_set *dss, struct destripe_chunk *c,
+				struct bio *bio, struct bvec_iter iter)
+{
+	unsigned long pos = (unsigned long)destripe_in_chunk(dss,
+				dm_target_offset(dss->ti, iter.bi_sector)) << SECTOR_SHIFT;
+	unsigned int first = DIV_ROUND_UP(pos, PAGE_SIZE);
+	unsigned int last = (pos + iter.bi_size) >> PAGE_SHIFT, p, added = 0;
+	unsigned long flags;
+
+	if (first >= last)
+		return;
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	if (hlist_unhashed(&c->hash)) {
+		spin_unlock_irqrestore(&dss->cache_lock, flags);
+		return;
+	}
+	for (p = first; p < last; p++) {
+		if (c->pages[p])
+			continue;
+		c->pages[p] = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+		if (!c->pages[p])
+			break;
+		added++;
+	}
+	last = p;
+	c->nr_held += added;
+	destripe_cache_charge(dss, c, added);
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+
+	/* pages not valid yet are only read once we set their bits below */
+	destripe_chunk_copy(c->pages, bio, iter, pos, true);
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	if (!hlist_unhashed(&c->hash)) {
+		for (p = first; p < last; p++)
+			__set_bit(p, c->valid);
+		destripe_cache_reclaim(dss, dss->cache_max_pages);
+	}
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+}
+
+/*
+ * prefetch: a sequential read of the target is strided on the striped source
+ * (one chunk out of every <stripes>), so the readahead of the backing device
+ * reads the other members' chunks and the page cache readahead of the target
+ * does not follow the stride. We detect the sequential read streams instead
+ * and read the next chunks of the target into the chunk cache, asynchronously.
+ *
+ * Called with cache_lock held. A read continuing a tracked stream (at, or less
+ * than a chunk past, its end) advances it, any other read replaces the least
+ * recently used stream. For a confirmed stream, returns the number of chunks
+ * to prefetch past the current one, their target offsets in ra[].
+ */
+static unsigned int destripe_ra_stream(struct destripe_set *dss, sector_t offset,
+				unsigned int sectors, sector_t *ra)
+{
+	struct destripe_stream *s, *lru = &dss->ra_streams[0];
+	uint32_t chunk = dss->geom.chunk_size;
+	sector_t t, end;
+	unsigned int i, nr = 0;
+
+	for (i = 0; i < DESTRIPE_RA_STREAMS; i++) {
+		s = &dss->ra_streams[i];
+		if (s->seq && offset >= s->next && offset < s->next + chunk)
+			break;
+		if (time_before(s->last, lru->last))
+			lru = s;
+	}
+	if (i == DESTRIPE_RA_STREAMS) {
+		s = lru;
+		s->seq = 0;
+		s->ra_next = 0;
+	}
+
+	s->next = offset + sectors;
+	s->last = jiffies;
+	if (++s->seq < DESTRIPE_RA_TRIGGER)
+		return 0;
+
+	/* keep ra_depth chunks ahead of the current one: one new chunk per chunk read */
+	t = offset + destripe_geom_chunk_left(&dss->geom, offset);
+	end = min_t(sector_t, t + (sector_t)dss->ra_depth * chunk, dss->ti->len);
+	for (t = max(t, s->ra_next); t < end; t += chunk)
+		ra[nr++] = t;
+	s->ra_next = max(s->ra_next, end);
+
+	return nr;
+}
+
+static void destripe_ra_endio(struct bio *bio)
+{
+	struct destripe_chunk *c = bio->bi_private;
+
+	if (unlikely(bio->bi_status))
+		set_bit(DSC_ERROR, &c->state);
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&c->io_pending))
+		queue_work(destripe_wq, &c->work);
+}
+
+/* A chunk read in (or failed): complete its waiters, from the chunk or the device */
+static void destripe_ra_done(struct work_struct *work)
+{
+	struct destripe_chunk *c = container_of(work, struct destripe_chunk, work);
+	struct destripe_set *dss = c->dss;
+	bool ok = !test_bit(DSC_ERROR, &c->state);
+	struct bio_list waiters;
+	unsigned long flags;
+	struct bio *bio;
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	if (ok) {
+		bitmap_fill(c->valid, c->nr_pages);
+		clear_bit(DSC_READING, &c->state);
+	} else if (!hlist_unhashed(&c->hash))
+		destripe_cache_unlink(dss, c);
+	waiters = c->waiters;
+	bio_list_init(&c->waiters);
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+
+	while ((bio = bio_list_pop(&waiters))) {
+		if (ok) {
+			destripe_chunk_copy(c->pages, bio, bio->bi_iter,
+				(unsigned long)destripe_in_chunk(dss, dm_target_offset(dss->ti,
+					bio->bi_iter.bi_sector)) << SECTOR_SHIFT, false);
+			bio_endio(bio);
+		} else {
+			bio_set_dev(bio, destripe_map_sector(dss, bio->bi_iter.bi_sector,
+							&bio->bi_iter.bi_sector)->dev->bdev);
+			submit_bio_noacct(bio);
+		}
+	}
+
+	destripe_chunk_put(c);
+	if (atomic_dec_and_test(&dss->ra_inflight))
+		wake_up(&dss->ra_wait);
+}
+
+/*
+ * Prefetch the chunk at target offset (chunk aligned), unless already cached.
+ * For a REQ_NOWAIT reader (nowait), the reads are REQ_NOWAIT too: a busy
+ * device fails them with BLK_STS_AGAIN and the chunk is a miss.
+ */
+static void destripe_ra_issue(struct destripe_set *dss, sector_t offset, unsigned int nowait)
+{
+	sector_t key = destripe_geom_map(&dss->geom, offset), dev_sector;
+	struct destripe_chunk *c;
+	unsigned int p = 0;
+	unsigned long flags;
+	struct destripe *d;
+	struct bio *bio;
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	c = destripe_cache_lookup(dss, key);
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+	if (c)
+		return;
+
+	c = destripe_chunk_alloc(dss, offset, key, true);
+	if (!c)
+		return;
+	c->state = (1UL << DSC_READING) | (1UL << DSC_PREFETCHED);
+	INIT_WORK(&c->work, destripe_ra_done);
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	if (destripe_cache_lookup(dss, key)) {
+		spin_unlock_irqrestore(&dss->cache_lock, flags);
+		destripe_chunk_put(c);
+		return;
+	}
+	destripe_cache_insert(dss, c);	/* the read holds the alloc ref */
+	destripe_cache_reclaim(dss, dss->cache_max_pages);
+	dss->ra_issued++;
+	atomic_inc(&dss->ra_inflight);
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+
+	/* a chunk never straddles two backing devices */
+	d = destripe_map_sector(dss, dss->ti->begin + offset, &dev_sector);
+	while (p < c->nr_pages) {
+		bio = bio_alloc(GFP_NOWAIT | __GFP_NOWARN,
+				min_t(unsigned int, c->nr_pages - p, BIO_MAX_VECS));
+		if (!bio) {
+			set_bit(DSC_ERROR, &c->state);
+			break;
+		}
+		bio_set_dev(bio, d->dev->bdev);
+		bio->bi_iter.bi_sector = dev_sector + ((sector_t)p << (PAGE_SHIFT - SECTOR_SHIFT));
+		bio->bi_opf = REQ_OP_READ | REQ_RAHEAD | nowait;
+		bio->bi_end_io = destripe_ra_endio;
+		bio->bi_private = c;
+		while (p < c->nr_pages && bio_add_page(bio, c->pages[p], PAGE_SIZE, 0))
+			p++;
+		if (!bio->bi_vcnt) {
+			bio_put(bio);
+			set_bit(DSC_ERROR, &c->state);
+			break;
+		}
+		atomic_inc(&c->io_pending);
+		submit_bio_noacct(bio);
+	}
+
+	if (atomic_dec_and_test(&c->io_pending))
+		queue_work(destripe_wq, &c->work);
+}
+
+/*
+ * row_reads: all the sibling targets of a striped source (one per stripe
+ * index, see scripts/mkalldevs_dm_destripe.sh) read the same backing disk.
+ * Read together, they turn one sequential pass of the disk into N strided
+ * ones. With row_reads, a read miss fetches its whole stripe row, a chunk of
+ * every index, in one backing I/O and hands each chunk to the target
+ * exposing its index: into its chunk cache, where its reads of the chunk
+ * wait for or find it. Siblings are the row_reads targets on the same
+ * devices & geometry, grouped while resumed.
+ */
+static LIST_HEAD(destripe_groups);
+static DEFINE_SPINLOCK(destripe_groups_lock);
+
+/* Page the chunks of a row no target takes are read into, and dropped */
+static struct page *destripe_sink_page;
+
+/* Stripe indices exposed by a target, as a bit mask */
+static u64 destripe_idx_mask(struct destripe_set *dss)
+{
+	u64 mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < dss->geom.idx.nr; i++)
+		mask |= 1ULL << dss->geom.idx.idx[i];
+	return mask;
+}
+
+/* Do two targets destripe the same source, i.e. share the source sectors? */
+static bool destripe_same_source(struct destripe_set *a, struct destripe_set *b)
+{
+	unsigned int i;
+
+	if (a->geom.destripes != b->geom.destripes || a->geom.chunk_size != b->geom.chunk_size ||
+	    a->nr_devs != b->nr_devs)
+		return false;
+
+	for (i = 0; i < a->nr_devs; i++)
+		if (a->destripe[i].dev->bdev != b->destripe[i].dev->bdev ||
+		    a->destripe[i].physical_start != b->destripe[i].physical_start)
+			return false;
+	return true;
+}
+
+/* Called with destripe_groups_lock held */
+static void destripe_group_update(struct destripe_group *grp)
+{
+	struct destripe_set *m;
+
+	grp->idx_mask = 0;
+	list_for_each_entry(m, &grp->members, group_list)
+		grp->idx_mask |= destripe_idx_mask(m);
+}
+
+static void destripe_group_join(struct destripe_set *dss)
+{
+	struct destripe_group *grp, *new;
+	unsigned long flags;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+
+	spin_lock_irqsave(&destripe_groups_lock, flags);
+	if (dss->group)
+		goto out;
+	list_for_each_entry(grp, &destripe_groups, list)
+		if (destripe_same_source(dss, list_first_entry(&grp->members,
+						struct destripe_set, group_list)))
+			goto found;
+	if (!new) {
+		DMWARN("[%s] No memory for the sibling group, row_reads off", dss->name);
+		goto out;
+	}
+	grp = new;
+	new = NULL;
+	INIT_LIST_HEAD(&grp->members);
+	list_add(&grp->list, &destripe_groups);
+found:
+	list_add_tail(&dss->group_list, &grp->members);
+	dss->group = grp;
+	destripe_group_update(grp);
+out:
+	spin_unlock_irqrestore(&destripe_groups_lock, flags);
+	kfree(new);
+}
+
+/* No chunk is handed to the target once it left */
+static void destripe_group_leave(struct destripe_set *dss)
+{
+	struct destripe_group *grp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&destripe_groups_lock, flags);
+	grp = dss->group;
+	if (grp) {
+		list_del(&dss->group_list);
+		dss->group = NULL;
+		if (list_empty(&grp->members)) {
+			list_del(&grp->list);
+			kfree(grp);
+		} else
+			destripe_group_update(grp);
+	}
+	spin_unlock_irqrestore(&destripe_groups_lock, flags);
+}
+
+/* Drop a ref on a row read: the last one completes the chunks of the row */
+static void destripe_row_put(struct destripe_row *row)
+{
+	struct destripe_chunk *c;
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&row->pending))
+		return;
+
+	for (i = 0; i < row->nr; i++) {
+		c = row->chunks[i];
+		if (!c)
+			continue;
+		if (row->error)
+			set_bit(DSC_ERROR, &c->state);
+		if (atomic_dec_and_test(&c->io_pending))
+			queue_work(destripe_wq, &c->work);
+	}
+	kfree(row);
+}
+
+static void destripe_row_endio(struct bio *bio)
+{
+	struct destripe_row *row = bio->bi_private;
+
+	if (unlikely(bio->bi_status))
+		row->error = 1;
+	bio_put(bio);
+	destripe_row_put(row);
+}
+
+/*
+ * Read miss of a single chunk bio at source sector key (chunk aligned) with
+ * row_reads: read its row for the group. Returns DM_MAPIO_SUBMITTED if the
+ * bio waits for its chunk, else it is for the device (as when no sibling
+ * would take a chunk: the row read would not pay).
+ */
+static int destripe_row_read(struct destripe_set *dss, struct bio *bio, sector_t key)
+{
+	uint32_t chunk = dss->geom.chunk_size, n = dss->geom.destripes, own;
+	unsigned int chunk_pages = destripe_chunk_pages(dss), i, p;
+	struct destripe *d, *bio_dev = NULL;
+	struct destripe_chunk *c;
+	struct destripe_row *row;
+	struct destripe_set *m;
+	struct bio *rbio = NULL;
+	struct page *page;
+	sector_t row_start, s, t;
+	bool queued = false;
+	unsigned long flags;
+	u64 mask = 0;
+
+	destripe_geom_unmap(&dss->geom, key, &own);
+	row_start = key - (sector_t)own * chunk;
+
+	spin_lock_irqsave(&destripe_groups_lock, flags);
+	if (dss->group)
+		mask = dss->group->idx_mask;
+	spin_unlock_irqrestore(&destripe_groups_lock, flags);
+	if (hweight64(mask) < 2)
+		return DM_MAPIO_REMAPPED;
+
+	row = kzalloc(sizeof(*row) + n * sizeof(struct destripe_chunk *), GFP_NOWAIT | __GFP_NOWARN);
+	if (!row)
+		return DM_MAPIO_REMAPPED;
+	row->nr = n;
+	atomic_set(&row->pending, 1);
+
+	/* chunks for the indices the group exposes, the others go to the sink page */
+	for (i = 0; i < n; i++) {
+		if (!(mask & (1ULL << i)))
+			continue;
+		c = destripe_chunk_alloc(dss, 0, row_start + (sector_t)i * chunk, true);
+		if (!c)
+			goto fail;
+		c->state = 1UL << DSC_READING;
+		INIT_WORK(&c->work, destripe_ra_done);
+		row->chunks[i] = c;
+	}
+
+	/* hand each chunk to the member exposing its index, if it does not hold it yet */
+	spin_lock_irqsave(&destripe_groups_lock, flags);
+	if (!dss->group) {
+		spin_unlock_irqrestore(&destripe_groups_lock, flags);
+		goto fail;
+	}
+	for (i = 0; i < n; i++) {
+		c = row->chunks[i];
+		if (!c)
+			continue;
+		list_for_each_entry(m, &dss->group->members, group_list) {
+			t = destripe_geom_unmap_target(&m->geom, c->key);
+			if (t == (sector_t)-1 || t >= m->ti->len)
+				continue;
+
+			spin_lock(&m->cache_lock);
+			if (!destripe_cache_lookup(m, c->key)) {
+				c->dss = m;
+				c->offset = t;
+				destripe_cache_insert(m, c);
+				if (m == dss && i == own) {
+					bio_list_add(&c->waiters, bio);
+					queued = true;
+				}
+				destripe_cache_reclaim(m, m->cache_max_pages);
+				if (m != dss)
+					dss->row_handed++;
+			}
+			spin_unlock(&m->cache_lock);
+			break;
+		}
+		/* the read completion of the chunk belongs to its target now (or to us) */
+		atomic_inc(&c->dss->ra_inflight);
+	}
+	dss->row_reads++;
+	spin_unlock_irqrestore(&destripe_groups_lock, flags);
+
+	/* one read of the whole row, cut only where it changes backing device */
+	for (i = 0; i < n && !row->error; i++) {
+		s = row_start + (sector_t)i * chunk;
+		d = destripe_map_dev(dss, s);
+		for (p = 0; p < chunk_pages; p++) {
+			page = row->chunks[i] ? row->chunks[i]->pages[p] : destripe_sink_page;
+			if (rbio && (d != bio_dev || !bio_add_page(rbio, page, PAGE_SIZE, 0))) {
+				atomic_inc(&row->pending);
+				submit_bio_noacct(rbio);
+				rbio = NULL;
+			}
+			if (rbio)
+				continue;
+
+			rbio = bio_alloc(GFP_NOWAIT | __GFP_NOWARN, BIO_MAX_VECS);
+			if (!rbio) {
+				row->error = 1;
+				break;
+			}
+			bio_set_dev(rbio, d->dev->bdev);
+			rbio->bi_iter.bi_sector = s - d->source_start + d->physical_start +
+					((sector_t)p << (PAGE_SHIFT - SECTOR_SHIFT));
+			/* as the prefetch: failed with the bio's REQ_NOWAIT, the row is a miss */
+			rbio->bi_opf = REQ_OP_READ | (bio->bi_opf & REQ_NOWAIT);
+			rbio->bi_end_io = destripe_row_endio;
+			rbio->bi_private = row;
+			bio_dev = d;
+			bio_add_page(rbio, page, PAGE_SIZE, 0);
+		}
+	}
+	if (rbio) {
+		atomic_inc(&row->pending);
+		submit_bio_noacct(rbio);
+	}
+	destripe_row_put(row);
+
+	return queued ? DM_MAPIO_SUBMITTED : DM_MAPIO_REMAPPED;
+
+fail:
+	for (i = 0; i < n; i++)
+		if (row->chunks[i])
+			destripe_chunk_put(row->chunks[i]);
+	kfree(row);
+	return DM_MAPIO_REMAPPED;
+}
+
+/*
+ * Read side of the cache & prefetch: extend the read stream of the bio, serve
+ * it from a cached chunk or queue it on the chunk read in flight. A miss of a
+ * single chunk bio reads its stripe row with row_reads. Returns
+ * DM_MAPIO_SUBMITTED if the bio was taken, else it is for the device, with
+ * io->chunk to fill at end_io on a cache miss.
+ */
+static int destripe_cache_read(struct destripe_set *dss, struct bio *bio, struct destripe_io *io)
+{
+	sector_t offset = dm_target_offset(dss->ti, bio->bi_iter.bi_sector), key;
+	unsigned int sectors = bio_sectors(bio), in_chunk, nr_ra = 0, i;
+	bool cache = test_bit(DSS_FEAT_CACHE, &dss->features), hit = false, row = false;
+	sector_t ra[DESTRIPE_RA_MAX_DEPTH];
+	struct destripe_chunk *c = NULL;
+	unsigned long flags;
+	int r = DM_MAPIO_REMAPPED;
+
+	in_chunk = destripe_in_chunk(dss, offset);
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	if (test_bit(DSS_FEAT_PREFETCH, &dss->features))
+		nr_ra = destripe_ra_stream(dss, offset, sectors, ra);
+
+	if (in_chunk + sectors <= dss->geom.chunk_size) {
+		key = destripe_geom_map(&dss->geom, offset - in_chunk);
+		c = destripe_cache_lookup(dss, key);
+		if (c) {
+			if (test_bit(DSC_PREFETCHED, &c->state) &&
+			    !test_and_set_bit(DSC_HIT, &c->state))
+				destripe_ra_adapt(dss, true);
+			if (test_bit(DSC_AM, &c->state))
+				list_move(&c->lru, &dss->cache_am);
+
+			if (test_bit(DSC_READING, &c->state)) {
+				dss->cache_hits++;
+				bio_list_add(&c->waiters, bio);
+				r = DM_MAPIO_SUBMITTED;
+				c = NULL;
+			} else if (destripe_chunk_holds(c, in_chunk, sectors)) {
+				dss->cache_hits++;
+				hit = true;
+				atomic_inc(&c->ref);
+			} else if (cache) {
+				dss->cache_misses++;
+				atomic_inc(&c->ref);
+			} else
+				c = NULL;
+		} else if (test_bit(DSS_FEAT_ROW_READS, &dss->features)) {
+			dss->cache_misses++;
+			row = true;
+		} else if (cache) {
+			dss->cache_misses++;
+			c = destripe_chunk_alloc(dss, offset - in_chunk, key, false);
+			if (c) {
+				destripe_cache_insert(dss, c);	/* the bio holds the alloc ref */
+				destripe_cache_reclaim(dss, dss->cache_max_pages);
+			}
+		}
+	}
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+
+	for (i = 0; i < nr_ra; i++)
+		destripe_ra_issue(dss, ra[i], bio->bi_opf & REQ_NOWAIT);
+
+	if (hit) {
+		destripe_chunk_copy(c->pages, bio, bio->bi_iter,
+				(unsigned long)in_chunk << SECTOR_SHIFT, false);
+		destripe_chunk_put(c);
+		bio_endio(bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+	if (row)
+		return destripe_row_read(dss, bio, key);
+
+	if (c) {
+		io->chunk = c;
+		io->iter = bio->bi_iter;
+	}
+	return r;
+}
+
+/* Drop the cached chunks overlapping a written (or discarded) target range */
+static void destripe_cache_invalidate(struct destripe_set *dss, sector_t offset, sector_t sectors)
+{
+	uint32_t chunk = dss->geom.chunk_size;
+	struct destripe_chunk *c, *tmp;
+	sector_t t, end = offset + sectors;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	if (sectors > (sector_t)dss->cache_nr * chunk) {
+		/* large discards: fewer chunks cached than in the range */
+		list_for_each_entry_safe(c, tmp, &dss->cache_a1in, lru)
+			if (c->offset < end && c->offset + chunk > offset)
+				destripe_cache_unlink(dss, c);
+		list_for_each_entry_safe(c, tmp, &dss->cache_am, lru)
+			if (c->offset < end && c->offset + chunk > offset) {
+				destripe_ghost_add(dss, c->key);
+				destripe_cache_unlink(dss, c);
+			}
+	} else {
+		for (t = offset - destripe_in_chunk(dss, offset); t < end; t += chunk) {
+			c = destripe_cache_lookup(dss, destripe_geom_map(&dss->geom, t));
+			if (!c)
+				continue;
+			/* a re-read of a hot chunk goes back to Am */
+			if (test_bit(DSC_AM, &c->state))
+				destripe_ghost_add(dss, c->key);
+			destripe_cache_unlink(dss, c);
+		}
+	}
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+}
+
+/* Drop all cached chunks, ghosts & streams (features turned off, suspend) */
+static void destripe_cache_drop(struct destripe_set *dss)
+{
+	struct destripe_ghost *g;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dss->cache_lock, flags);
+	while (!list_empty(&dss->cache_a1in))
+		destripe_cache_unlink(dss, list_entry(dss->cache_a1in.next,
+						struct destripe_chunk, lru));
+	while (!list_empty(&dss->cache_am))
+		destripe_cache_unlink(dss, list_entry(dss->cache_am.next,
+						struct destripe_chunk, lru));
+	while (!list_empty(&dss->cache_a1out)) {
+		g = list_entry(dss->cache_a1out.next, struct destripe_ghost, list);
+		hlist_del(&g->hash);
+		list_del(&g->list);
+		kfree(g);
+	}
+	dss->cache_nr_ghosts = 0;
+	memset(dss->ra_streams, 0, sizeof(dss->ra_streams));
+	spin_unlock_irqrestore(&dss->cache_lock, flags);
+}
+
+/* Wait for the chunk reads in flight & drop the cache, no I/O is mapped any more */
+static void destripe_cache_quiesce(struct destripe_set *dss)
+{
+	wait_event(dss->ra_wait, !atomic_read(&dss->ra_inflight));
+	flush_workqueue(destripe_wq);
+	destripe_cache_drop(dss);
+}
+
+/*----------------------------------------------------------------- */
+
+/*
+ * write_back: small writes inside a chunk are copied into a per-chunk buffer
+ * and completed at once, the buffers are written back in physical order
+ * (dirty sector runs, one bio each) DESTRIPE_WB_DELAY_MS later, when the
+ * buffer space is full, or on demand:
+ *   - a flush waits for the write back of all the writes completed before it,
+ *     and fails if a write back failed since the last flush (ti->flush_supported,
+ *     the target is a volatile write cache);
+ *   - any other I/O overlapping a buffer (a read not held in it, a FUA write,
+ *     a multi-chunk write, a discard) is deferred until the buffer is written;
+ *   - presuspend stops the buffering, postsuspend & dtr drain the buffers.
+ */
+
+static inline struct hlist_head *destripe_wb_bucket(struct destripe_set *dss, sector_t key)
+{
+	return &dss->wb_hash[hash_64(key, DESTRIPE_WB_HASH_BITS)];
+}
+
+/* Called with wb_lock held: a buffer overlapping the target range */
+static struct destripe_wbuf *destripe_wb_find(struct destripe_set *dss, sector_t offset,
+				unsigned int sectors)
+{
+	uint32_t chunk = dss->geom.chunk_size;
+	struct destripe_wbuf *w;
+	sector_t t, end = offset + max(sectors, 1U);
+	unsigned int i;
+
+	if (sectors > (sector_t)dss->wb_nr * chunk) {
+		for (i = 0; i < ARRAY_SIZE(dss->wb_hash); i++)
+			hlist_for_each_entry(w, &dss->wb_hash[i], hash)
+				if (w->offset < end && w->offset + chunk > offset)
+					return w;
+		return NULL;
+	}
+
+	for (t = offset - destripe_in_chunk(dss, offset); t < end; t += chunk) {
+		sector_t key = destripe_geom_map(&dss->geom, t);
+
+		hlist_for_each_entry(w, destripe_wb_bucket(dss, key), hash)
+			if (w->key == key)
+				return w;
+	}
+	return NULL;
+}
+
+static void destripe_wbuf_free(struct destripe_wbuf *w)
+{
+	unsigned int i;
+
+	for (i = 0; i < w->nr_pages; i++)
+		if (w->pages[i])
+			__free_page(w->pages[i]);
+	kfree(w);
+}
+
+static void destripe_wb_done(struct work_struct *work);
+
+static struct destripe_wbuf *destripe_wbuf_alloc(struct destripe_set *dss, sector_t offset,
+				sector_t key)
+{
+	unsigned int nr_pages = destripe_chunk_pages(dss);
+	struct destripe_wbuf *w;
+
+	w = kzalloc(sizeof(*w) + nr_pages * sizeof(struct page *) +
+			BITS_TO_LONGS(dss->geom.chunk_size) * sizeof(unsigned long),
+			GFP_NOWAIT | __GFP_NOWARN);
+	if (!w)
+		return NULL;
+
+	INIT_HLIST_NODE(&w->hash);
+	INIT_LIST_HEAD(&w->list);
+	w->key = key;
+	w->offset = offset;
+	atomic_set(&w->io_pending, 1);
+	bio_list_init(&w->deferred);
+	INIT_WORK(&w->work, destripe_wb_done);
+	w->dss = dss;
+	w->nr_pages = nr_pages;
+	w->dirty = (unsigned long *)(w->pages + nr_pages);
+	return w;
+}
+
+/* Called with wb_lock held: the pages the sectors from in_chunk land in */
+static bool destripe_wb_pages(struct destripe_wbuf *w, unsigned int in_chunk, unsigned int sectors)
+{
+	unsigned int p = in_chunk >> (PAGE_SHIFT - SECTOR_SHIFT);
+	unsigned int last = (in_chunk + sectors - 1) >> (PAGE_SHIFT - SECTOR_SHIFT);
+
+	for (; p <= last; p++) {
+		if (w->pages[p])
+			continue;
+		w->pages[p] = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+		if (!w->pages[p])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Write side of the buffers, and the I/O overlapping them. Returns
+ * DM_MAPIO_SUBMITTED if the bio was buffered, served or deferred, else it is
+ * for the device (no buffer in its way, or no room for a new one).
+ */
+static int destripe_wb_map(struct destripe_set *dss, struct bio *bio)
+{
+	sector_t offset = dm_target_offset(dss->ti, bio->bi_iter.bi_sector), key;
+	unsigned int sectors = bio_sectors(bio), in_chunk = destripe_in_chunk(dss, offset);
+	bool single = sectors && in_chunk + sectors <= dss->geom.chunk_size;
+	bool write = bio_data_dir(bio) == WRITE, buffer, kick = false;
+	struct destripe_wbuf *w, *new = NULL;
+	unsigned long flags;
+	int r = DM_MAPIO_SUBMITTED;
+
+	buffer = write && single &&
+		 bio_op(bio) == REQ_OP_WRITE && !(bio->bi_opf & REQ_FUA) &&
+		 !READ_ONCE(dss->wb_suspended);
+	if (!buffer && !READ_ONCE(dss->wb_nr))
+		return DM_MAPIO_REMAPPED;
+
+	key = destripe_geom_map(&dss->geom, offset - in_chunk);
+again:
+	spin_lock_irqsave(&dss->wb_lock, flags);
+	if (single) {
+		w = NULL;
+		hlist_for_each_entry(w, destripe_wb_bucket(dss, key), hash)
+			if (w->key == key)
+				break;
+	} else
+		w = destripe_wb_find(dss, offset, sectors);
+
+	if (!w) {
+		if (!buffer || dss->wb_suspended || dss->wb_nr >= dss->wb_max) {
+			/* full: write back now, this one goes to the device */
+			kick = buffer && !dss->wb_suspended;
+			r = DM_MAPIO_REMAPPED;
+			goto out;
+		}
+		if (!new) {
+			spin_unlock_irqrestore(&dss->wb_lock, flags);
+			new = destripe_wbuf_alloc(dss, offset - in_chunk, key);
+			if (!new)
+				return DM_MAPIO_REMAPPED;
+			goto again;
+		}
+		w = new;
+		new = NULL;
+		hlist_add_head(&w->hash, destripe_wb_bucket(dss, key));
+		list_add_tail(&w->list, &dss->wb_dirty);
+		if (!dss->wb_nr++)
+			queue_delayed_work(destripe_wq, &dss->wb_work,
+					msecs_to_jiffies(DESTRIPE_WB_DELAY_MS));
+	}
+
+	if (!test_bit(DSW_WRITING, &w->state)) {
+		if (buffer && destripe_wb_pages(w, in_chunk, sectors)) {
+			destripe_chunk_copy(w->pages, bio, bio->bi_iter,
+					(unsigned long)in_chunk << SECTOR_SHIFT, true);
+			bitmap_set(w->dirty, in_chunk, sectors);
+			dss->wb_buffered++;
+			/* a whole chunk: nothing left to coalesce */
+			kick = bitmap_full(w->dirty, dss->geom.chunk_size);
+			spin_unlock_irqrestore(&dss->wb_lock, flags);
+			bio_endio(bio);
+			goto out_unlocked;
+		}
+		if (!write && single && find_next_zero_bit(w->dirty, in_chunk + sectors,
+							   in_chunk) >= in_chunk + sectors) {
+			destripe_chunk_copy(w->pages, bio, bio->bi_iter,
+					(unsigned long)in_chunk << SECTOR_SHIFT, false);
+			spin_unlock_irqrestore(&dss->wb_lock, flags);
+			bio_endio(bio);
+			goto out_unlocked;
+		}
+		kick = true;
+	}
+	bio_list_add(&w->deferred, bio);
+	dss->wb_deferred++;
+out:
+	spin_unlock_irqrestore(&dss->wb_lock, flags);
+out_unlocked:
+	if (kick)
+		mod_delayed_work(destripe_wq, &dss->wb_work, 0);
+	if (new)
+		destripe_wbuf_free(new);
+	return r;
+}
+
+/* Map a deferred bio again, once the buffer in its way is written back */
+static void destripe_wb_resubmit(struct destripe_set *dss, struct bio *bio)
+{
+	int r;
+
+	if (destripe_wb_map(dss, bio) == DM_MAPIO_SUBMITTED)
+		return;
+
+	/* its submitter is long gone, the daemon may block */
+	bio->bi_opf &= ~REQ_NOWAIT;
+
+	if (destripe_range_op(bio))
+		r = destripe_map_range(dss, bio);
+	else if (bio_sectors(bio) > destripe_geom_chunk_left(&dss->geom,
+					dm_target_offset(dss->ti, bio->bi_iter.bi_sector)))
+		r = destripe_map_split(dss, bio);
+	else {
+		bio_set_dev(bio, destripe_map_sector(dss, bio->bi_iter.bi_sector,
+						&bio->bi_iter.bi_sector)->dev->bdev);
+		r = DM_MAPIO_REMAPPED;
+	}
+	if (r == DM_MAPIO_REMAPPED)
+		submit_bio_noacct(bio);
+}
+
+static void destripe_wb_endio(struct bio *bio)
+{
+	struct destripe_wbuf *w = bio->bi_private;
+
+	if (unlikely(bio->bi_status))
+		w->error = 1;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&w->io_pending))
+		queue_work(destripe_wq, &w->work);
+}
+
+/*
+ * Drop a write back reference (a buffer written, or the daemon done
+ * submitting). The last one releases the flushes that waited for the
+ * buffers, here: the daemon never sleeps on the completions, which run on
+ * the same (rescuer only under memory pressure) workqueue.
+ */
+static void destripe_wb_put(struct destripe_set *dss)
+{
+	struct bio_list flushes;
+	unsigned long flags;
+	struct bio *bio;
+	blk_status_t error;
+
+	bio_list_init(&flushes);
+	spin_lock_irqsave(&dss->wb_lock, flags);
+	if (atomic_dec_and_test(&dss->wb_writing)) {
+		flushes = dss->wb_flushing;
+		bio_list_init(&dss->wb_flushing);
+	}
+	spin_unlock_irqrestore(&dss->wb_lock, flags);
+
+	if (!bio_list_empty(&flushes)) {
+		error = xchg(&dss->wb_error, 0) ? BLK_STS_IOERR : BLK_STS_OK;
+		while ((bio = bio_list_pop(&flushes))) {
+			if (error)
+				destripe_bio_endio(bio, error);
+			else
+				submit_bio_noacct(bio);
+		}
+	}
+	wake_up(&dss->wb_wait);
+}
+
+/* A buffer written back (or failed): drop it & map the I/O deferred on it */
+static void destripe_wb_done(struct work_struct *work)
+{
+	struct destripe_wbuf *w = container_of(work, struct destripe_wbuf, work);
+	struct destripe_set *dss = w->dss;
+	struct destripe *d = destripe_map_dev(dss, w->key);
+	struct bio_list deferred;
+	unsigned long flags;
+	struct bio *bio;
+
+	if (unlikely(w->error)) {
+		DMERR("[%s] Write back of chunk at source sector %llu failed on %s", dss->name,
+				(unsigned long long)w->key, d->dev->name);
+		atomic_inc(&d->error_count);
+		if (atomic_read(&d->error_count) < READ_ONCE(dss->err_threshold))
+			schedule_work(&dss->trigger_event);
+	}
+
+	/* reads of the chunk read meanwhile (prefetch, row_reads) cached the old data */
+	if (READ_ONCE(dss->cache_nr))
+		destripe_cache_invalidate(dss, w->offset, dss->geom.chunk_size);
+
+	spin_lock_irqsave(&dss->wb_lock, flags);
+	if (w->error)
+		dss->wb_error = 1;
+	hlist_del(&w->hash);
+	dss->wb_nr--;
+	dss->wb_written++;
+	deferred = w->deferred;
+	spin_unlock_irqrestore(&dss->wb_lock, flags);
+
+	if (READ_ONCE(dss->cache_nr))
+		destripe_cache_invalidate(dss, w->offset, dss->geom.chunk_size);
+
+	while ((bio = bio_list_pop(&deferred)))
+		destripe_wb_resubmit(dss, bio);
+
+	destripe_wbuf_free(w);
+	destripe_wb_put(dss);
+}
+
+/* Write back the dirty sector runs of a buffer, a chunk never straddles two devices */
+static void destripe_wb_write(struct destripe_set *dss, struct destripe_wbuf *w)
+{
+	struct destripe *d = destripe_map_dev(dss, w->key);
+	sector_t dev_sector = w->key - d->source_start + d->physical_start;
+	unsigned int chunk = dss->geom.chunk_size, s = 0, end, len;
+	struct bio *bio = NULL;
+
+	while ((s = find_next_bit(w->dirty, chunk, s)) < chunk) {
+		end = find_next_zero_bit(w->dirty, chunk, s);
+		for (; s < end; s += len) {
+			len = min(end - s, (unsigned int)(PAGE_SIZE >> SECTOR_SHIFT) -
+					(s & ((PAGE_SIZE >> SECTOR_SHIFT) - 1)));
+			if (bio && bio_add_page(bio, w->pages[s >> (PAGE_SHIFT - SECTOR_SHIFT)],
+						to_bytes(len), to_bytes(s) & ~PAGE_MASK))
+				continue;
+			if (bio) {
+				atomic_inc(&w->io_pending);
+				submit_bio_noacct(bio);
+			}
+
+			/* never fails: waits for the fs bioset, only the daemon writes back */
+			bio = bio_alloc(GFP_NOIO, min_t(unsigned int, w->nr_pages, BIO_MAX_VECS));
+			bio_set_dev(bio, d->dev->bdev);
+			bio->bi_iter.bi_sector = dev_sector + s;
+			bio->bi_opf = REQ_OP_WRITE;
+			bio->bi_end_io = destripe_wb_endio;
+			bio->bi_private = w;
+			bio_add_page(bio, w->pages[s >> (PAGE_SHIFT - SECTOR_SHIFT)],
+					to_bytes(len), to_bytes(s) & ~PAGE_MASK);
+		}
+		/* one bio per dirty run */
+		if (bio) {
+			atomic_inc(&w->io_pending);
+			submit_bio_noacct(bio);
+			bio = NULL;
+		}
+	}
+
+	if (atomic_dec_and_test(&w->io_pending))
+		queue_work(destripe_wq, &w->work);
+}
+
+static int destripe_wb_cmp(void *priv, const struct list_head *a, const struct list_head *b)
+{
+	struct destripe_wbuf *wa = list_entry(a, struct destripe_wbuf, list);
+	struct destripe_wbuf *wb = list_entry(b, struct destripe_wbuf, list);
+
+	return wa->key < wb->key ? -1 : wa->key > wb->key;
+}
+
+/*
+ * Write back daemon: all the dirty buffers, in physical order. The flushes
+ * that came meanwhile go once the buffers they cover are on disk, released
+ * by the last destripe_wb_put(); the daemon holds a reference while it
+ * submits, so that they cannot go before the batch is written.
+ */
+static void destripe_wb_work(struct work_struct *work)
+{
+	struct destripe_set *dss = container_of(to_delayed_work(work), struct destripe_set,
+						wb_work);
+	struct destripe_wbuf *w, *tmp;
+	struct blk_plug plug;
+	unsigned long flags;
+	LIST_HEAD(batch);
+
+	spin_lock_irqsave(&dss->wb_lock, flags);
+	atomic_inc(&dss->wb_writing);
+	bio_list_merge(&dss->wb_flushing, &dss->wb_flushes);
+	bio_list_init(&dss->wb_flushes);
+	list_splice_init(&dss->wb_dirty, &batch);
+	list_for_each_entry(w, &batch, list) {
+		set_bit(DSW_WRITING, &w->state);
+		atomic_inc(&dss->wb_writing);
+	}
+	spin_unlock_irqrestore(&dss->wb_lock, flags);
+
+	list_sort(NULL, &batch, destripe_wb_cmp);
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(w, tmp, &batch, list) {
+		list_del_init(&w->list);
+		destripe_wb_write(dss, w);
+	}
+	blk_finish_plug(&plug);
+
+	destripe_wb_put(dss);
+}
+
+/* A flush (already remapped) waits for the write back, if anything is buffered */
+static bool destripe_wb_flush(struct destripe_set *dss, struct bio *bio)
+{
+	unsigned long flags;
+	bool deferred;
+
+	spin_lock_irqsave(&dss->wb_lock, flags);
+	deferred = dss->wb_nr || dss->wb_error;
+	if (deferred)
+		bio_list_add(&dss->wb_flushes, bio);
+	spin_unlock_irqrestore(&dss->wb_lock, flags);
+
+	if (deferred)
+		mod_delayed_work(destripe_wq, &dss->wb_work, 0);
+	return deferred;
+}
+
+/* Write back all the buffers & wait for them (suspend, dtr) */
+static void destripe_wb_drain(struct destripe_set *dss)
+{
+	while (READ_ONCE(dss->wb_nr)) {
+		mod_delayed_work(destripe_wq, &dss->wb_work, 0);
+		flush_delayed_work(&dss->wb_work);
+		wait_event(dss->wb_wait, !atomic_read(&dss->wb_writing));
+	}
+}
+
+static void destripe_wb_init(struct destripe_set *dss)
+{
+	unsigned int i;
+
+	spin_lock_init(&dss->wb_lock);
+	for (i = 0; i < ARRAY_SIZE(dss->wb_hash); i++)
+		INIT_HLIST_HEAD(&dss->wb_hash[i]);
+	INIT_LIST_HEAD(&dss->wb_dirty);
+	bio_list_init(&dss->wb_flushes);
+	bio_list_init(&dss->wb_flushing);
+	dss->wb_nr = 0;
+	dss->wb_max = max((DESTRIPE_WB_MAX_MB << (20 - SECTOR_SHIFT)) / dss->geom.chunk_size, 1U);
+	dss->wb_suspended = false;
+	dss->wb_error = 0;
+	atomic_set(&dss->wb_writing, 0);
+	init_waitqueue_head(&dss->wb_wait);
+	INIT_DELAYED_WORK(&dss->wb_work, destripe_wb_work);
+	dss->wb_buffered = dss->wb_written = dss->wb_deferred = 0;
+}
+
+/* ----------------------------------------------------------------
+ * Destripe mapping function -> All the I/O action goes through here!
+ *
+ * NOTE: bios within one chunk are remapped as is, so a polled bio (no dm
+ * polling before 5.18, the poll flag is dropped at submission) would reach
+ * the backing queue unchanged; the bios the target builds itself (splits,
+ * prefetch, row reads, write back) always complete by interrupt.
+ */
+static int destripe_map(struct dm_target *ti, struct bio *bio)
+{
+	struct destripe_set *dss = ti->private;
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
+
+	io->start = ktime_get();
+	io->chunk = NULL;
+
+	if (bio->bi_opf & REQ_PREFLUSH) {
+		destripe_account(dss, DSS_IO_FLUSH, 0);
+
+		/* one flush per backing device (ti->num_flush_bios) */
+		bio_set_dev(bio, dss->destripe[dm_bio_get_target_bio_nr(bio)].dev->bdev);
+		if ((test_bit(DSS_FEAT_WRITE_BACK, &dss->features) || READ_ONCE(dss->wb_error)) &&
+		    destripe_wb_flush(dss, bio))
+			return DM_MAPIO_SUBMITTED;
+		return DM_MAPIO_REMAPPED;
+	}
+	if (unlikely(destripe_range_op(bio))) {
+		BUG_ON(dm_bio_get_target_bio_nr(bio) != 0);
+		destripe_account(dss, destripe_io_type(bio), bio->bi_iter.bi_size);
+		io->offset = dm_target_offset(ti, bio->bi_iter.bi_sector);
+		io->sectors = bio_sectors(bio);
+		if (READ_ONCE(dss->cache_nr))
+			destripe_cache_invalidate(dss, io->offset, io->sectors);
+		if (test_bit(DSS_FEAT_WRITE_BACK, &dss->features) &&
+		    destripe_wb_map(dss, bio) == DM_MAPIO_SUBMITTED)
+			return DM_MAPIO_SUBMITTED;
+		return destripe_map_range(dss, bio);
+	}
+
+	/* Handling writes... fwd them and get a callback at destripe_end_io() */
+	if (bio_data_dir(bio) == WRITE) {
+
+		DRSDEBUG("[%s] dm-destripe REQ: WRITE Addr: %lld Size: %d\n", dm_device_name(dsd),
+		   				(unsigned long long)bio->bi_iter.bi_sector << 9, bio->bi_iter.bi_size);
+
+		destripe_account(dss, DSS_IO_WRITE, bio->bi_iter.bi_size);
+
+		/* cached chunks are dropped now and, for reads issued meanwhile, at end_io */
+		io->offset = dm_target_offset(ti, bio->bi_iter.bi_sector);
+		io->sectors = bio_sectors(bio);
+		if (READ_ONCE(dss->cache_nr))
+			destripe_cache_invalidate(dss, io->offset, io->sectors);
+
+		if (test_bit(DSS_FEAT_WRITE_BACK, &dss->features) &&
+		    destripe_wb_map(dss, bio) == DM_MAPIO_SUBMITTED)
+			return DM_MAPIO_SUBMITTED;
+
+	} else { /* It's all about the reads here... */
+
+		DRSDEBUG("[%s] dm-destripe REQ: READ Addr: %lld Size: %d\n", dm_device_name(dsd),
+						(unsigned long long)bio->bi_iter.bi_sector << 9, bio->bi_iter.bi_size);
+
+		destripe_account(dss, DSS_IO_READ, bio->bi_iter.bi_size);
+
+		if (test_bit(DSS_FEAT_WRITE_BACK, &dss->features) &&
+		    destripe_wb_map(dss, bio) == DM_MAPIO_SUBMITTED)
+			return DM_MAPIO_SUBMITTED;
+		if ((dss->features & DSS_FEAT_CHUNK_CACHE) &&
+		    destripe_cache_read(dss, bio, io) == DM_MAPIO_SUBMITTED)
+			return DM_MAPIO_SUBMITTED;
+	}
+
+	/* Only with split_bios may a bio cross a chunk boundary (or cut just before
+	 * it was turned off): not the feature bit, the bio decides */
+	if (bio_sectors(bio) > destripe_geom_chunk_left(&dss->geom,
+					dm_target_offset(ti, bio->bi_iter.bi_sector)))
+		return destripe_map_split(dss, bio);
+
+	bio_set_dev(bio, destripe_map_sector(dss, bio->bi_iter.bi_sector, &bio->bi_iter.bi_sector)->dev->bdev);
+
+	return DM_MAPIO_REMAPPED;
+}
+
+/*----------------------------------------------------------------- */
+
+/* NOTE: the destripe_end_io handler is called after the async
+ *       read/write_callback() functions... */
+
+static int destripe_end_io(struct dm_target *ti, struct bio *bio, blk_status_t *error)
+{
+	struct destripe_set *dss = (struct destripe_set *) ti->private;
+	struct destripe_io *io = dm_per_bio_data(bio, sizeof(struct destripe_io));
+	char major_minor[16];
+	unsigned int i;
+	int type;
+
+	DRSDEBUG_CALL("destripe_end_io called...\n");
+
+	/* Update our completed I/O counters & latency histograms... */
+	destripe_account_done(dss, bio, io->start);
+
+	type = destripe_io_type(bio);
+	if ((type == DSS_IO_WRITE || type == DSS_IO_DISCARD) && READ_ONCE(dss->cache_nr))
+		destripe_cache_invalidate(dss, io->offset, io->sectors);
+
+	/* cache miss: keep what was read */
+	if (io->chunk) {
+		if (!*error)
+			destripe_cache_fill(dss, io->chunk, bio, io->iter);
+		destripe_chunk_put(io->chunk);
+	}
+
+	if (!*error)
+		return DM_ENDIO_DONE; /* No error, I/O completed successfully */
+
+	/* Oops... error occurred... */
+	/* turned down, not failed: readahead or non-blocking (REQ_NOWAIT) bios */
+	if ((*error == BLK_STS_AGAIN) && (bio->bi_opf & (REQ_RAHEAD | REQ_NOWAIT)))
+		return DM_ENDIO_DONE;
+
+	if (*error == BLK_STS_NOTSUPP)
+		return DM_ENDIO_DONE;
+
+	memset(major_minor, 0, sizeof(major_minor));
+	sprintf(major_minor, "%d:%d",
+		MAJOR(bio->bi_bdev->bd_dev), MINOR(bio->bi_bdev->bd_dev));
+
+	/*
+	 * Test to see which stripe drive triggered the error event
+	 * and increment error count for all stripes on that device.
+	 * If the error count for a given device exceeds the threshold
+	 * value we will no longer trigger any further events.
+	 */
+	for (i = 0; i < dss->nr_devs; i++)
+		if (!strcmp(dss->destripe[i].dev->name, major_minor)) {
+			atomic_inc(&(dss->destripe[i].error_count));
+			if (atomic_read(&(dss->destripe[i].error_count)) <
+			    READ_ONCE(dss->err_threshold))
+				schedule_work(&dss->trigger_event);
+		}
+
+	return DM_ENDIO_DONE;
+}
+
+/*----------------------------------------------------------------- */
+
+static void destripe_presuspend(struct dm_target *ti)
+{
+	struct destripe_set *dss = (struct destripe_set *) ti->private;
+
+	DRSDEBUG_CALL("destripe_presuspend called...\n");
+	atomic_set(&dss->suspend, 1);
+
+	/* the siblings stop handing us chunks before our reads are quiesced */
+	if (test_bit(DSS_FEAT_ROW_READS, &dss->features))
+		destripe_group_leave(dss);
+
+	/* writes go straight to the devices, what is buffered is written back now */
+	if (test_bit(DSS_FEAT_WRITE_BACK, &dss->features)) {
+		spin_lock_irq(&dss->wb_lock);
+		dss->wb_suspended = true;
+		spin_unlock_irq(&dss->wb_lock);
+		mod_delayed_work(destripe_wq, &dss->wb_work, 0);
+	}
+}
+
+/*----------------------------------------------------------------- */
+
+static void destripe_postsuspend(struct dm_target *ti)
+{
+	struct destripe_set *dss = (struct destripe_set *) ti->private;
+
+	DRSDEBUG_CALL("destripe_postsuspend called...\n");
+	assert( atomic_read(&dss->suspend) == 1); // should already be suspended...
+
+	/* nothing stays buffered while suspended */
+	if (test_bit(DSS_FEAT_WRITE_BACK, &dss->features))
+		destripe_wb_drain(dss);
+
+	/* the backing data may change while suspended: no cached chunk survives */
+	destripe_cache_quiesce(dss);
+}
+
+/*----------------------------------------------------------------- */
+
+static void destripe_resume(struct dm_target *ti)
+{
+	struct destripe_set *dss = (struct destripe_set *) ti->private;
+
+	DRSDEBUG_CALL("destripe_resume called...\n");
+
+	/* NOTE: this assertion is wrong, because resume is called also at device init...
+	assert( atomic_read(&dss->suspend) == 1);
+	 */
+
+	atomic_set(&dss->suspend, 0); /* lower suspend flag... */
+
+	if (test_bit(DSS_FEAT_ROW_READS, &dss->features))
+		destripe_group_join(dss);
+	if (test_bit(DSS_FEAT_WRITE_BACK, &dss->features))
+		WRITE_ONCE(dss->wb_suspended, false);
+}
+
+/*----------------------------------------------------------------- */
+
+/*
+ * Turn a feature on or off (feature message). split_bios changes the size dm
+ * core cuts bios at, row_reads joins or leaves the sibling group, write_back
+ * is drained before it goes off, as on suspend. The chunk cache is resized
+ * by the caller.
+ */
+static int destripe_feature_set(struct destripe_set *dss, unsigned int f, bool on)
+{
+	struct dm_target *ti = dss->ti;
+	int r;
+
+	if (on == test_bit(f, &dss->features))
+		return 0;
+
+	switch (f) {
+	case DSS_FEAT_SPLIT_BIOS:
+		/* bios already cut either way are still mapped right, see destripe_map() */
+		if (on)
+			WRITE_ONCE(ti->max_io_len, 0);
+		else {
+			r = dm_set_target_max_io_len(ti, dss->geom.chunk_size);
+			if (r)
+				return r;
+		}
+		break;
+
+	case DSS_FEAT_ROW_READS:
+		if (on && (u64)dss->geom.destripes * dss->geom.chunk_size > DESTRIPE_ROW_MAX_KB * 2) {
+			DMERR("[%s] Stripe row too large for row_reads (max 4MB)", dss->name);
+			return -EINVAL;
+		}
+		/* row reads in flight still complete into our chunk cache */
+		if (!on)
+			destripe_group_leave(dss);
+		break;
+
+	case DSS_FEAT_WRITE_BACK:
+		/* the queue gets flushes (REQ_PREFLUSH) only if the table had write_back */
+		if (on && !ti->flush_supported) {
+			DMERR("[%s] Feature write_back needs a table reload to be enabled",
+					dss->name);
+			return -EINVAL;
+		}
+		spin_lock_irq(&dss->wb_lock);
+		dss->wb_suspended = !on || atomic_read(&dss->suspend);
+		spin_unlock_irq(&dss->wb_lock);
+		/* writes now go straight to the devices, nothing stays buffered */
+		if (!on)
+			destripe_wb_drain(dss);
+		break;
+	}
+
+	if (on)
+		set_bit(f, &dss->features);
+	else
+		clear_bit(f, &dss->features);
+
+	if (on && f == DSS_FEAT_ROW_READS && !atomic_read(&dss->suspend))
+		destripe_group_join(dss);
+	return 0;
+}
+
+/* Runtime tuning via the message interface, no suspend/reload needed. */
+static int destripe_message(struct dm_target *ti, unsigned argc, char **argv,
+			    char *result, unsigned maxlen)
+{
+	struct destripe_set *dss = ti->private;
+	unsigned int val, f;
+	int r;
+
+	DRSDEBUG_CALL("destripe_message called...\n");
+
+	/* INFO: valid message forms [ALWAYS 4 args - use 0 for unused values]:
+	 * io_cmd <command_type> <cmd_arg1> <cmd_arg2>
+	 *
+	 * io_cmd could be:
+	 *   io_cmd reset_stats 0 0            : restart the status I/O counters & latencies
+	 *   io_cmd reset_errors 0 0           : zero the device error counts (re-arms events)
+	 *   io_cmd err_threshold <errors> 0   : device errors triggering a dm event (default 15)
+	 *   io_cmd feature <name> <0|1>       : toggle a feature (DSS_FEAT_RUNTIME ones only)
+	 *   io_cmd cache_mb <MB> 0            : chunk cache size (cache feature, default 64)
+	 */
+	if (argc != 4 || strncmp(argv[0], "io_cmd", strlen(argv[0])) ) {
+
+		DMERR("[%s] Invalid command or argument number (need 4 args)", dss->name);
+		return -EINVAL;
+	}
+
+	if (!strcasecmp(argv[1], "reset_stats")) {
+		destripe_stats_reset(dss);
+		DMINFO("[%s] I/O statistics reset", dss->name);
+		return 0;
+	}
+
+	if (!strcasecmp(argv[1], "reset_errors")) {
+		for (f = 0; f < dss->nr_devs; f++)
+			atomic_set(&dss->destripe[f].error_count, 0);
+		DMINFO("[%s] Device error counts reset", dss->name);
+		return 0;
+	}
+
+	if (!strcasecmp(argv[1], "err_threshold")) {
+		if (kstrtouint(argv[2], 10, &val) || !val) {
+			DMERR("[%s] Invalid error threshold %s", dss->name, argv[2]);
+			return -EINVAL;
+		}
+		dss->err_threshold = val;
+		DMINFO("[%s] Error event threshold set to %u", dss->name, val);
+		return 0;
+	}
+
+	if (!strcasecmp(argv[1], "cache_mb")) {
+		if (kstrtouint(argv[2], 10, &val) || !val || val > DESTRIPE_CACHE_MAX_MB) {
+			DMERR("[%s] Invalid cache size %s MB", dss->name, argv[2]);
+			return -EINVAL;
+		}
+		dss->cache_mb = val;
+		destripe_cache_resize(dss);
+		DMINFO("[%s] Chunk cache size set to %u MB", dss->name, val);
+		return 0;
+	}
+
+	if (!strcasecmp(argv[1], "feature")) {
+		for (f = 0; f < DSS_FEAT_MAX; f++)
+			if (!strcasecmp(argv[2], destripe_feature_names[f]))
+				break;
+		if (f == DSS_FEAT_MAX || kstrtouint(argv[3], 10, &val) || val > 1) {
+			DMERR("[%s] Invalid feature %s or value %s", dss->name, argv[2], argv[3]);
+			return -EINVAL;
+		}
+		if (!(DSS_FEAT_RUNTIME & (1UL << f))) {
+			DMERR("[%s] Feature %s can only be changed by a table reload",
+					dss->name, argv[2]);
+			return -EINVAL;
+		}
+		if (val && ((1UL << f) & DSS_FEAT_NO_DAX) && READ_ONCE(dss->dax_used)) {
+			DMERR("[%s] Feature %s unavailable, the device is mapped through DAX",
+					dss->name, argv[2]);
+			return -EINVAL;
+		}
+		r = destripe_feature_set(dss, f, val);
+		if (r)
+			return r;
+		if ((1UL << f) & DSS_FEAT_CHUNK_CACHE) {
+			destripe_cache_resize(dss);
+			if (!(dss->features & DSS_FEAT_CHUNK_CACHE))
+				destripe_cache_drop(dss);
+		}
+		DMINFO("[%s] Feature %s %s", dss->name, destripe_feature_names[f],
+				val ? "enabled" : "disabled");
+		return 0;
+	}
+
+	DMERR("[%s] Unknown io_cmd %s", dss->name, argv[1]);
+	return -EINVAL;
+}
+
+/*----------------------------------------------------------------- */
+
+/* Returns status information about the destripe dev... */
+
+static void destripe_status(struct dm_target *ti, status_type_t type,
+			 unsigned status_flags, char *result, unsigned int maxlen)
+{
+	unsigned int sz = 0, nr_features, i;
+	struct destripe_set *dss = (struct destripe_set *) ti->private;
+	struct destripe_counters sum;
+	u64 hist[DESTRIPE_LAT_BUCKETS], rd_pending, wr_pending;
+	int b;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		DRSDEBUG("destripe_status STATUSTYPE_INFO...\n");
+		DMEMIT("\ndestripe[%s] stripes=%u idx=%s "
+				"chunk_size=%u chunk_size_shift=%d phys_size=%lu",
+				dss->name, dss->geom.destripes, dss->idx_spec,
+				dss->geom.chunk_size, dss->geom.chunk_size_shift,
+				(unsigned long)dss->physical_size);
+		for (i = 0; i < dss->nr_devs; i++)
+			DMEMIT("\ndestripe[%s] dev %u: %s source=%llu+%llu errors=%d", dss->name, i,
+				dss->destripe[i].dev->name,
+				(unsigned long long)dss->destripe[i].source_start,
+				(unsigned long long)dss->destripe[i].source_secs,
+				atomic_read(&dss->destripe[i].error_count));
+		destripe_stats_fold(dss, &sum);
+		rd_pending = destripe_stats_pending(&sum, DSS_IO_READ);
+		wr_pending = destripe_stats_pending(&sum, DSS_IO_WRITE);
+		destripe_stats_rebase(dss, &sum);
+		DMEMIT("\ndestripe[%s] IO Count: TRD: %llu ORD: %llu TWR: %llu OWR: %llu", dss->name,
+				(unsigned long long)sum.ios[DSS_IO_READ], (unsigned long long)rd_pending,
+				(unsigned long long)sum.ios[DSS_IO_WRITE], (unsigned long long)wr_pending);
+		DMEMIT("\ndestripe[%s] IO Bytes: RD: %llu WR: %llu DISCARD: %llu (%llu ios) FLUSH: %llu ios",
+				dss->name, (unsigned long long)sum.bytes[DSS_IO_READ],
+				(unsigned long long)sum.bytes[DSS_IO_WRITE],
+				(unsigned long long)sum.bytes[DSS_IO_DISCARD],
+				(unsigned long long)sum.ios[DSS_IO_DISCARD],
+				(unsigned long long)sum.ios[DSS_IO_FLUSH]);
+		for (i = 0; i < DSS_IO_MAX; i++) {
+			if (!sum.done[i])
+				continue;
+			destripe_stats_fold_latency(dss, i, hist);
+			for (b = 0; b < DESTRIPE_LAT_BUCKETS; b++)
+				hist[b] -= dss->stats_base.lat[i][b];
+			DMEMIT("\ndestripe[%s] Latency %s (us): p50<=%llu p90<=%llu "
+					"p99<=%llu p99.9<=%llu max<=%llu", dss->name,
+					destripe_io_type_names[i],
+					(unsigned long long)destripe_latency_percentile(hist, 500),
+					(unsigned long long)destripe_latency_percentile(hist, 900),
+					(unsigned long long)destripe_latency_percentile(hist, 990),
+					(unsigned long long)destripe_latency_percentile(hist, 999),
+					(unsigned long long)destripe_latency_percentile(hist, 1000));
+		}
+		if (dss->features & DSS_FEAT_CHUNK_CACHE)
+			DMEMIT("\ndestripe[%s] Cache: pages=%u/%u (a1in %u) chunks=%u ghosts=%u "
+					"hits=%llu misses=%llu", dss->name, dss->cache_pages,
+					dss->cache_max_pages, dss->cache_a1in_pages, dss->cache_nr,
+					dss->cache_nr_ghosts, (unsigned long long)dss->cache_hits,
+					(unsigned long long)dss->cache_misses);
+		if (test_bit(DSS_FEAT_PREFETCH, &dss->features) || dss->ra_issued)
+			DMEMIT("\ndestripe[%s] Prefetch: depth=%u issued=%llu hits=%llu wasted=%llu",
+					dss->name, dss->ra_depth, (unsigned long long)dss->ra_issued,
+					(unsigned long long)dss->ra_hits,
+					(unsigned long long)dss->ra_wasted);
+		if (test_bit(DSS_FEAT_ROW_READS, &dss->features))
+			DMEMIT("\ndestripe[%s] Row reads: %s rows=%llu handed=%llu", dss->name,
+					READ_ONCE(dss->group) ? "grouped" : "alone",
+					(unsigned long long)dss->row_reads,
+					(unsigned long long)dss->row_handed);
+		if (test_bit(DSS_FEAT_WRITE_BACK, &dss->features))
+			DMEMIT("\ndestripe[%s] Write back: chunks=%u/%u writes=%llu written=%llu "
+					"deferred=%llu", dss->name, dss->wb_nr, dss->wb_max,
+					(unsigned long long)dss->wb_buffered,
+					(unsigned long long)dss->wb_written,
+					(unsigned long long)dss->wb_deferred);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DRSDEBUG("destripe_status STATUSTYPE_TABLE...\n");
+		DMEMIT("%u %s %u %u", dss->geom.destripes, dss->idx_spec,
+				dss->geom.chunk_size, dss->nr_devs);
+		for (i = 0; i < dss->nr_devs; i++)
+			DMEMIT(" %s %llu", dss->destripe[i].dev->name,
+				(unsigned long long)dss->destripe[i].physical_start);
+		nr_features = hweight_long(dss->features);
+		if (nr_features) {
+			DMEMIT(" %u", nr_features);
+			for (i = 0; i < DSS_FEAT_MAX; i++)
+				if (test_bit(i, &dss->features))
+					DMEMIT(" %s", destripe_feature_names[i]);
+		}
+		break;
+
+	case STATUSTYPE_IMA:
+		DMEMIT_TARGET_NAME_VERSION(ti->type);
+		DMEMIT(",destripes=%u,idx=%s,chunk_size=%u,nr_devs=%u",
+		       dss->geom.destripes, dss->idx_spec, dss->geom.chunk_size, dss->nr_devs);
+		for (i = 0; i < dss->nr_devs; i++)
+			DMEMIT(",destripe_%u_device_name=%s,destripe_%u_physical_start=%llu",
+			       i, dss->destripe[i].dev->name,
+			       i, (unsigned long long)dss->destripe[i].physical_start);
+		DMEMIT(",features=%lx;", dss->features);
+		break;
+	}
+}
+
+/*----------------------------------------------------------------- */
+
+/*
+ * An event is triggered whenever a drive
+ * drops out of a destripe volume.
+ */
+static void trigger_event(struct work_struct *work)
+{
+	struct destripe_set *dss = container_of(work, struct destripe_set,
+					   trigger_event);
+	dm_table_event(dss->ti->table);
+}
+
+static inline struct destripe_set *alloc_ds_context(unsigned int nr_devs)
+{
+	size_t len;
+
+	if (dm_array_too_big(sizeof(struct destripe_set), sizeof(struct destripe), nr_devs))
+		return NULL;
+
+	len = sizeof(struct destripe_set) + nr_devs * sizeof(struct destripe);
+
+	return kmalloc(len, GFP_KERNEL);
+}
+
+/*-----------------------------------------------------------------
+ * Target functions
+ *---------------------------------------------------------------*/
+
+/* Parse the optional feature args: [<#feature args> <feature>...] */
+static int destripe_parse_features(struct dm_target *ti, unsigned int argc, char **argv,
+				unsigned long *features)
+{
+	unsigned int nr_features, i, f;
+
+	*features = 0;
+	if (!argc)
+		return 0;
+
+	if (kstrtouint(argv[0], 10, &nr_features) || nr_features != argc - 1) {
+		ti->error = "Invalid number of feature args";
+		return -EINVAL;
+	}
+
+	for (i = 1; i < argc; i++) {
+		for (f = 0; f < DSS_FEAT_MAX; f++)
+			if (!strcasecmp(argv[i], destripe_feature_names[f]))
+				break;
+		if (f == DSS_FEAT_MAX) {
+			ti->error = "Unrecognised destripe feature requested";
+			return -EINVAL;
+		}
+		set_bit(f, features);
+	}
+	return 0;
+}
+
+/*
+ * Get destination device i from its <dev path> <offset> pair. It holds the
+ * source sectors from source_start, up to the end of the device.
+ */
+static int destripe_get_dev(struct dm_target *ti, struct destripe_set *dss, unsigned int i,
+			char **argv, sector_t source_start)
+{
+	struct destripe *d = &dss->destripe[i];
+	unsigned long long start;
+	sector_t width;
+	char dummy;
+
+	if (sscanf(argv[1], "%llu%c", &start, &dummy) != 1) {
+		ti->error = "Couldn't parse destripe destination device";
+		return -EINVAL;
+	}
+
+	if (dm_get_device(ti, argv[0],
+			dm_table_get_mode(ti->table), &d->dev)) {
+		ti->error = "Invalid destripe destination device";
+		return -ENXIO;
+	}
+
+	d->physical_secs = bdev_nr_sectors(d->dev->bdev);
+
+	if (start >= d->physical_secs) {
+		ti->error = "Destination device offset beyond the device size";
+		goto fail_dev;
+	}
+
+	d->physical_start = start;
+	d->source_start = source_start;
+	d->source_secs = d->physical_secs - start;
+	atomic_set(&(d->error_count), 0);
+
+	if (i && source_start >= dss->physical_size) {
+		ti->error = "More destination devices than needed for the target length";
+		goto fail_dev;
+	}
+
+	/* a chunk must not straddle two devices, so only the last may end unaligned */
+	width = d->source_secs;
+	if (i < dss->nr_devs - 1 && sector_div(width, dss->geom.chunk_size)) {
+		ti->error = "Destination device size (from offset) not a multiple of chunk size";
+		goto fail_dev;
+	}
+
+	return 0;
+
+fail_dev:
+	dm_put_device(ti, d->dev);
+	return -EINVAL;
+}
+
+/*
+ * Construct a destripe (reverse stripe) mapping:
+ *
+ * Arguments: <number of stripes> <de-stripe index> <chunk size (sectors)> <...device arguments...>
+ *            [<#feature args> <feature>...]
+ *
+ * De-stripe index: <idx> exposes one stripe index, <idx>,<idx>,... several of them
+ * interleaved (re-striped with the same chunk size), <idx>+<idx>+... several of them
+ * concatenated. The target length must be a multiple of chunk size * indices.
+ *
+ * Device arguments: <#devs> <dev path> <offset (sectors)> [<dev path> <offset>...]
+ *   The striped source is the concatenation of the devices, each from its
+ *   offset up to its end. All but the last must hold a whole number of chunks.
+ *
+ * Features:
+ *   split_bios: bios spanning several chunks are split into per-chunk clones
+ *               by the target, instead of dm core cloning & mapping each chunk.
+ *   prefetch:   sequential read streams are detected and the next chunks of the
+ *               target read ahead into the chunk cache.
+ *   cache:      chunks read are kept in a 2Q chunk cache of cache_mb MB.
+ *   row_reads:  a read miss reads the whole stripe row once for all the sibling
+ *               targets (other indices of the same source) into their caches.
+ *   write_back: writes within a chunk are buffered, coalesced and written back
+ *               in physical order; flushes wait for them (volatile write cache).
+ *   all of them may also be toggled by message (see destripe_message()).
+ */
+static int destripe_ctr(struct dm_target *ti, unsigned int argc, char **argv)
+{
+	struct destripe_set *dss;
+	struct mapped_device *dsd;
+	struct destripe_idx_set idx_set;
+	sector_t member_len, source_start;
+	uint32_t destripes, chunk_size;
+	unsigned int nr_devs, i;
+	unsigned long features;
+	const char *geom_err;
+	int r;
+
+
+	DRSDEBUG_CALL("destripe_ctr called...\n");
+
+	if (argc < 3) {
+		ti->error = "Not enough arguments (need at least 3)";
+		return -EINVAL;
+	}
+
+	if (kstrtouint(argv[0], 10, &destripes)) {
+		ti->error = "Invalid stripe count (must be 2-64)";
+		return -EINVAL;
+	}
+
+	if (kstrtouint(argv[2], 10, &chunk_size) || !chunk_size) {
+		ti->error = "Invalid chunk_size";
+		return -EINVAL;
+	}
+
+	if ((geom_err = destripe_geom_check(destripes, 0, chunk_size))) {
+		ti->error = (char *)geom_err;
+		return -EINVAL;
+	}
+
+	/* <de-stripe index> is a single index, or a set of them: "i,j,..." interleaved
+	 * (re-striped with the same chunk size) or "i+j+..." concatenated */
+	if ((geom_err = destripe_idx_parse(argv[1], destripes, &idx_set)) ||
+	    (geom_err = destripe_geom_check_len(&idx_set, chunk_size, ti->len))) {
+		ti->error = (char *)geom_err;
+		return -EINVAL;
+	}
+
+	/* <#devs> destination devices (2 dev args each), features are optional */
+	if (argc < 4) {
+		ti->error = "Destripe needs 3 arguments and the destination devices specified";
+		return -EINVAL;
+	}
+
+	if (kstrtouint(argv[3], 10, &nr_devs) || !nr_devs || nr_devs > DESTRIPE_MAX_DEVS) {
+		ti->error = "Invalid number of destination devices";
+		return -EINVAL;
+	}
+
+	if (argc < 4 + 2 * nr_devs) {
+		ti->error = "Destripe needs 3 arguments and <#devs> destination devices specified";
+		return -EINVAL;
+	}
+
+	r = destripe_parse_features(ti, argc - 4 - 2 * nr_devs, argv + 4 + 2 * nr_devs, &features);
+	if (r)
+		return r;
+
+	/* a row read holds the whole stripe row in memory */
+	if (test_bit(DSS_FEAT_ROW_READS, &features) &&
+	    (u64)destripes * chunk_size > DESTRIPE_ROW_MAX_KB * 2) {
+		ti->error = "Stripe row too large for row_reads (max 4MB)";
+		return -EINVAL;
+	}
+
+	/* set maximum size of I/O submitted to a target to chunk (more will be split),
+	 * dm core also splits at non power of 2 chunk boundaries. With split_bios
+	 * we get whole bios and split them ourselves in destripe_map_split(). */
+	if (!test_bit(DSS_FEAT_SPLIT_BIOS, &features)) {
+		r = dm_set_target_max_io_len(ti, chunk_size);
+		if (r)
+			return r;
+	}
+
+	if ( !(dss = alloc_ds_context(nr_devs)) ) {
+		ti->error = "Memory allocation for destripe context failed";
+		return -ENOMEM;
+	}
+
+	dsd = dm_table_get_md(ti->table);
+
+	/* check the name of the device... this is actually the major:minor device
+	 * name in the kernel and should not exceed 10 chars... */
+	if ( strlen(dm_device_name(dsd)) >= DEVNAME_MAXLEN ) {
+		ti->error = "Internal error: dm-device name too long!";
+		kfree(dss);
+		return -EINVAL;
+	}
+	/* copy the device name locally... */
+	memset( dss->name, 0, DEVNAME_MAXLEN );
+	memcpy( dss->name, dm_device_name(dsd), strlen( dm_device_name(dsd) ) );
+
+	INIT_WORK(&dss->trigger_event, trigger_event);
+	INIT_LIST_HEAD(&dss->group_list);
+
+	/* Set pointer to dm target; used in trigger_event */
+	dss->ti = ti;
+	dss->nr_devs = nr_devs;
+	dss->features = features;
+	dss->dax_used = false;
+	/* each member index is destriped from the same number of chunks (rows) */
+	member_len = ti->len;
+	sector_div(member_len, idx_set.nr);
+	destripe_geom_init_set(&dss->geom, destripes, &idx_set, chunk_size, member_len);
+	destripe_idx_print(&idx_set, dss->idx_spec, sizeof(dss->idx_spec));
+	dss->physical_size = member_len * dss->geom.destripes;
+
+	/* check out include/linux/device-mapper.h for tuning more settings... */
+	ti->num_flush_bios = nr_devs;
+	ti->num_discard_bios = 1;
+	ti->num_write_same_bios = 1;
+	/* blkdev_issue_zeroout() offloads with write zeroes, mapped like discards */
+	ti->num_write_zeroes_bios = 1;
+	ti->per_bio_data_size = sizeof(struct destripe_io);
+
+	dss->err_threshold = DM_IO_ERROR_THRESHOLD;
+	memset(&dss->stats_base, 0, sizeof(dss->stats_base));
+
+	/* IO counters, zeroed by alloc_percpu() */
+	dss->stats = alloc_percpu(struct destripe_stats);
+	if (!dss->stats) {
+		ti->error = "Memory allocation for destripe statistics failed";
+		kfree(dss);
+		return -ENOMEM;
+	}
+
+	/* write_back: the target is a volatile cache, it needs the flushes */
+	destripe_wb_init(dss);
+	if (test_bit(DSS_FEAT_WRITE_BACK, &features))
+		ti->flush_supported = true;
+
+	/* Chunk cache (cache & prefetch features), its size may be changed by message */
+	i = 0;
+	r = destripe_cache_init(dss);
+	if (r) {
+		ti->error = "Memory allocation for destripe chunk cache failed";
+		dss->cache_hash = NULL;
+		goto fail_ctr_devs;
+	}
+
+	/*
+	 * Get the destination devices by parsing the <dev> <sector> pairs: the striped
+	 * source is their concatenation, each from its offset up to its end.
+	 */
+	argv += 4;
+
+	for (i = 0, source_start = 0; i < nr_devs; i++) {
+		r = destripe_get_dev(ti, dss, i, argv + 2 * i, source_start);
+		if (r)
+			goto fail_ctr_devs;
+		source_start += dss->destripe[i].source_secs;
+	}
+
+	/* target length must be at least destripes * ti->len to support target address space... */
+	if (source_start < dss->physical_size) {
+		ti->error = "Physical device capacity not enough to support destripes on requested target length";
+		r = -EINVAL;
+		goto fail_ctr_devs;
+	}
+
+	if (source_start > dss->physical_size) {
+		DMWARN("[%s] WARNING: Larger physical space than required! DeStripe using only %lu of %lu sectors.",
+				dss->name, (unsigned long) dss->physical_size,
+				(unsigned long) source_start );
+		dss->destripe[nr_devs - 1].source_secs -= source_start - dss->physical_size;
+	}
+
+	r = register_shrinker(&dss->cache_shrinker);
+	if (r) {
+		ti->error = "Failed to register destripe cache shrinker";
+		goto fail_ctr_devs;
+	}
+
+	ti->private = dss;
+
+	DMINFO("Device %s INIT OK: len=%lu destripes=%u idx:%s phys_size=%lu "
+	   		"chunk_size=%u ck_sz_shift=%d map=%s devs=%u",
+			dss->name, ti->len, dss->geom.destripes, dss->idx_spec,
+			(unsigned long)dss->physical_size, dss->geom.chunk_size, dss->geom.chunk_size_shift,
+			destripe_map_class_name(&dss->geom), dss->nr_devs);
+
+	return 0;
+
+fail_ctr_devs:
+	while (i--)
+		dm_put_device(ti, dss->destripe[i].dev);
+	kvfree(dss->cache_hash);
+	free_percpu(dss->stats);
+	kfree(dss);
+	return r;
+}
+
+/*----------------------------------------------------------------- */
+
+static void destripe_dtr(struct dm_target *ti)
+{
+	struct destripe_set *dss = (struct destripe_set *) ti->private;
+	unsigned int i;
+
+	DRSDEBUG_CALL("destripe_dtr called...\n");
+	DMWARN("[%s] DeStripe Device EXIT.", dss->name);
+
+	unregister_shrinker(&dss->cache_shrinker);
+	destripe_group_leave(dss);
+	/* also when write_back was turned off: its work may still release flushes */
+	WRITE_ONCE(dss->wb_suspended, true);
+	destripe_wb_drain(dss);
+	cancel_delayed_work_sync(&dss->wb_work);
+	destripe_cache_quiesce(dss);
+
+	for (i = 0; i < dss->nr_devs; i++)
+		dm_put_device(ti, dss->destripe[i].dev);
+
+	flush_work(&dss->trigger_event);
+	kvfree(dss->cache_hash);
+	free_percpu(dss->stats);
+	kfree(dss);
+}
+
+static int destripe_iterate_devices(struct dm_target *ti,
+				  iterate_devices_callout_fn fn, void *data)
+{
+	struct destripe_set *dss = (struct destripe_set *) ti->private;
+	unsigned int i;
+	int r = 0;
+
+	DRSDEBUG_CALL("destripe_iterate_devices called...\n");
+
+	/* every device: dm core also asks here whether all of them support polling (5.18+) */
+	for (i = 0; i < dss->nr_devs && !r; i++)
+		r = fn(ti, dss->destripe[i].dev, dss->destripe[i].physical_start,
+			dss->destripe[i].source_secs, data);
+
+	return r;
+}
+
+/*----------------------------------------------------------------- */
+
+static void destripe_io_hints(struct dm_target *ti,
+			    struct queue_limits *limits)
+{
+	struct destripe_set *dss = ti->private;
+	unsigned chunk_size = dss->geom.chunk_size << SECTOR_SHIFT;
+	unsigned width = dss->geom.idx.layout == DESTRIPE_LAYOUT_INTERLEAVED ? dss->geom.idx.nr : 1;
+	unsigned int i;
+	sector_t start;
+	bool aligned;
+
+	/* physical block size & the other device limits are stacked by dm core */
+
+	/* io_opt: a full row of interleaved indices (sizes the readahead) */
+	blk_limits_io_min(limits, chunk_size);
+	blk_limits_io_opt(limits, chunk_size * width);
+
+	/* an I/O of max_sectors from a chunk boundary ends on one */
+	if (limits->max_sectors > dss->geom.chunk_size)
+		limits->max_sectors = rounddown(limits->max_sectors, dss->geom.chunk_size);
+
+	/* discards are split per chunk: granules must not straddle chunks */
+	if (!limits->max_discard_sectors)
+		return;
+	aligned = limits->discard_granularity && !(chunk_size % limits->discard_granularity);
+	for (i = 0; aligned && i < dss->nr_devs; i++) {
+		start = dss->destripe[i].physical_start << SECTOR_SHIFT;
+		aligned = !sector_div(start, limits->discard_granularity);
+	}
+	if (!aligned)
+		limits->discard_granularity = chunk_size;
+	limits->discard_alignment = 0;
+}
+
+/*----------------------------------------------------------------- */
+
+#if IS_ENABLED(CONFIG_DAX_DRIVER)
+
+/*
+ * DAX: the device & device sector of a target page offset. *nr_pages is cut
+ * to the pages physically contiguous on that device: the rest of the chunk,
+ * then the next chunks as long as they follow it on the same device.
+ */
+static struct destripe *destripe_dax_map(struct destripe_set *dss, pgoff_t pgoff,
+					long *nr_pages, sector_t *dev_sector)
+{
+	sector_t sector = (sector_t)pgoff << (PAGE_SHIFT - SECTOR_SHIFT);
+	sector_t offset = dm_target_offset(dss->ti, sector);
+	sector_t phys = destripe_geom_map(&dss->geom, offset);
+	sector_t want = (sector_t)*nr_pages << (PAGE_SHIFT - SECTOR_SHIFT), len;
+	struct destripe *d = destripe_map_sector(dss, sector, dev_sector);
+
+	len = destripe_geom_chunk_left(&dss->geom, offset);
+	while (len < want && offset + len < dss->ti->len &&
+	       destripe_geom_map(&dss->geom, offset + len) == phys + len &&
+	       destripe_map_dev(dss, phys + len) == d)
+		len += dss->geom.chunk_size;
+
+	*nr_pages = min(len, want) >> (PAGE_SHIFT - SECTOR_SHIFT);
+	return d;
+}
+
+static long destripe_dax_direct_access(struct dm_target *ti, pgoff_t pgoff,
+				long nr_pages, void **kaddr, pfn_t *pfn)
+{
+	struct destripe_set *dss = ti->private;
+	sector_t dev_sector;
+	struct destripe *d;
+	long ret;
+
+	/* cached or buffered data would not be seen by mapped accesses */
+	if (READ_ONCE(dss->features) & DSS_FEAT_NO_DAX)
+		return -EOPNOTSUPP;
+	if (!READ_ONCE(dss->dax_used))
+		WRITE_ONCE(dss->dax_used, true);
+
+	d = destripe_dax_map(dss, pgoff, &nr_pages, &dev_sector);
+	ret = bdev_dax_pgoff(d->dev->bdev, dev_sector, nr_pages * PAGE_SIZE, &pgoff);
+	if (ret)
+		return ret;
+	return dax_direct_access(d->dev->dax_dev, pgoff, nr_pages, kaddr, pfn);
+}
+
+/* copies stay within the range of one direct_access(), i.e. one device */
+static size_t destripe_dax_copy_from_iter(struct dm_target *ti, pgoff_t pgoff,
+				void *addr, size_t bytes, struct iov_iter *i)
+{
+	struct destripe_set *dss = ti->private;
+	long nr_pages = DIV_ROUND_UP(bytes, PAGE_SIZE);
+	sector_t dev_sector;
+	struct destripe *d;
+
+	d = destripe_dax_map(dss, pgoff, &nr_pages, &dev_sector);
+	if (bdev_dax_pgoff(d->dev->bdev, dev_sector, ALIGN(bytes, PAGE_SIZE), &pgoff))
+		return 0;
+	return dax_copy_from_iter(d->dev->dax_dev, pgoff, addr, bytes, i);
+}
+
+static size_t destripe_dax_copy_to_iter(struct dm_target *ti, pgoff_t pgoff,
+				void *addr, size_t bytes, struct iov_iter *i)
+{
+	struct destripe_set *dss = ti->private;
+	long nr_pages = DIV_ROUND_UP(bytes, PAGE_SIZE);
+	sector_t dev_sector;
+	struct destripe *d;
+
+	d = destripe_dax_map(dss, pgoff, &nr_pages, &dev_sector);
+	if (bdev_dax_pgoff(d->dev->bdev, dev_sector, ALIGN(bytes, PAGE_SIZE), &pgoff))
+		return 0;
+	return dax_copy_to_iter(d->dev->dax_dev, pgoff, addr, bytes, i);
+}
+
+static int destripe_dax_zero_page_range(struct dm_target *ti, pgoff_t pgoff,
+				size_t nr_pages)
+{
+	struct destripe_set *dss = ti->private;
+	sector_t dev_sector;
+	pgoff_t dev_pgoff;
+	struct destripe *d;
+	long len;
+	int r;
+
+	/* one contiguous run at a time */
+	while (nr_pages) {
+		len = nr_pages;
+		d = destripe_dax_map(dss, pgoff, &len, &dev_sector);
+		r = bdev_dax_pgoff(d->dev->bdev, dev_sector, len << PAGE_SHIFT, &dev_pgoff);
+		if (!r)
+			r = dax_zero_page_range(d->dev->dax_dev, dev_pgoff, len);
+		if (r)
+			return r;
+		pgoff += len;
+		nr_pages -= len;
+	}
+	return 0;
+}
+
+#else
+#define destripe_dax_direct_access NULL
+#define destripe_dax_copy_from_iter NULL
+#define destripe_dax_copy_to_iter NULL
+#define destripe_dax_zero_page_range NULL
+#endif
+
+/*----------------------------------------------------------------- */
+
+/*
+ * NOTE: bio-based only. A request-based target (clone_and_map_rq) can only
+ *       pick the device of a request: dm-rq copies the request position to
+ *       the clone (blk_rq_prep_clone()), there is no hook to remap sectors.
+ *       The remapped bios still go through the backing blk-mq queue, its
+ *       plug & elevator merging, tags and scheduler.
+ */
+static struct target_type destripe_target = {
+	.name	 = "destripe",
+	.version = {1, 0, 0},
+	.module	 = THIS_MODULE,
+	.ctr	 = destripe_ctr,	/* Contructor function */
+	.dtr	 = destripe_dtr,	/* Destructor function */
+	.map	 = destripe_map,	/* Map function */
+	.end_io	 = destripe_end_io,	/* End_io function */
+	.presuspend = destripe_presuspend,	/* Pre-suspend function */
+	.postsuspend = destripe_postsuspend,	/* Post-suspend function */
+	.resume	 = destripe_resume,	/* Resume function */
+	.message = destripe_message,	/* Message function */
+	.status	 = destripe_status,	/* Status function */
+	.iterate_devices = destripe_iterate_devices,
+	.io_hints = destripe_io_hints,
+	.direct_access = destripe_dax_direct_access,
+	.dax_copy_from_iter = destripe_dax_copy_from_iter,
+	.dax_copy_to_iter = destripe_dax_copy_to_iter,
+	.dax_zero_page_range = destripe_dax_zero_page_range,
+	.features = DM_TARGET_NOWAIT,
+};
+
+
+static int __init dm_destripe_init(void)
+{
+	int r = -ENOMEM;
+
+	/* the split clones are allocated under submit_bio_noacct(), with the
+	 * previous ones parked on current->bio_list: those need the rescuer */
+	r = bioset_init(&destripe_bs, DESTRIPE_SPLIT_POOL_SIZE, 0, BIOSET_NEED_RESCUER);
+	if (r) {
+		DMERR("[%s] Failed to create split bioset", destripe_target.name);
+		return r;
+	}
+	r = -ENOMEM;
+
+	destripe_wq = alloc_workqueue("kdestriped", WQ_MEM_RECLAIM, 0);
+	if (!destripe_wq) {
+		DMERR("[%s] Failed to create workqueue", destripe_target.name);
+		bioset_exit(&destripe_bs);
+		return r;
+	}
+
+	destripe_sink_page = alloc_page(GFP_KERNEL);
+	if (!destripe_sink_page) {
+		DMERR("[%s] Failed to allocate the row_reads sink page", destripe_target.name);
+		destroy_workqueue(destripe_wq);
+		bioset_exit(&destripe_bs);
+		return r;
+	}
+
+	r = dm_register_target(&destripe_target);
+	if (r < 0) {
+		DMERR("[%s] Failed to register destripe target", destripe_target.name);
+		__free_page(destripe_sink_page);
+		destroy_workqueue(destripe_wq);
+		bioset_exit(&destripe_bs);
+		return r;
+	}
+
+	printk(KERN_INFO "dm-destripe L313 [Build: %s %s]: Loaded OK.\n", __DATE__, __TIME__);
+
+	return r;
+}
+
+static void __exit dm_destripe_exit(void)
+{
+	printk(KERN_INFO "dm-destripe L313 [Build: %s %s]: Exiting.\n", __DATE__, __TIME__);
+
+	dm_unregister_target(&destripe_target);
+	__free_page(destripe_sink_page);
+	destroy_workqueue(destripe_wq);
+	bioset_exit(&destripe_bs);
+}
+
+/* Module hooks */
+module_init(dm_destripe_init);
+module_exit(dm_destripe_exit);
+
+MODULE_AUTHOR("Michail Flouris <michail.flouris at onapp.com>");
+MODULE_DESCRIPTION(
+	"(C) Copyright OnApp Ltd. 2012-2013  All Rights Reserved.\n"
+	DM_NAME " destripe target for reversing stripe-mapped data to a single volume "
+);
+MODULE_LICENSE("GPL");
@@ -15,19 +15,19 @@ dname=$1 # need dev argument!
 destripes=$2 # need number of destripes argument
 chunksize=$3 # need chunk size argument
 
-if [ $destripes -lt 2 ] || [ $destripes -gt 8 ] ; then
-	echo "Stripes must be between 2 and 8!"
+if [ $destripes -lt 2 ] || [ $destripes -gt 64 ] ; then
+	echo "Stripes must be between 2 and 64!"
 	exit -1
 fi
 
 if [ $chunksize -lt 8 ] || [ $chunksize -gt 16384 ] ; then
-	echo "Chunksize must be between 8 and 16384 sectors and power of 2!"
+	echo "Chunksize must be between 8 and 16384 sectors and a multiple of 8!"
 	exit -1
 fi
 
-let "chunkdiv = $chunksize % 2"
+let "chunkdiv = $chunksize % 8"
 if [ $chunkdiv -ne 0 ] ; then
-	echo "Chunksize must be power of 2!"
+	echo "Chunksize must be a multiple of 8 sectors (4KB)!"
 	exit -1
 fi
 
@@ -14,8 +14,8 @@ fi
 dname=$1 # need dev argument!
 destripes=$2 # need number of destripes argument
 
-if [ $destripes -lt 2 ] || [ $destripes -gt 8 ] ; then
-	echo "Stripes must be between 2 and 8!"
+if [ $destripes -lt 2 ] || [ $destripes -gt 64 ] ; then
+	echo "Stripes must be between 2 and 64!"
 	exit -1
 fi
 
@@ -10,7 +10,8 @@
 # NOTE: assumes dm-destripe module is already loaded.
 
 if [ -z $4 ] ; then
-	echo "Usage: $0 <block dev to destripe> <number of stripes> <chunk size (sectors)> <destriped devs prefix in /dev/mapper/>"
+	echo "Usage: $0 <block dev to destripe> <number of stripes> <chunk size (sectors)> <destriped devs prefix in /dev/mapper/> [<feature>...]"
+	echo "       e.g. row_reads, to read each stripe row once for all the destriped devices"
 	exit 2
 fi
 
@@ -18,6 +19,8 @@ devname=$1 # need target dev argument!
 stripes=$2 # need number of stripes argument
 chunksize=$3 # need chunk size argument (in sectors, as in dm table)
 outdmdev=$4 # output device name under /dev/mapper/
+shift 4
+features="$*" # optional feature args, same for all destriped devices
 
 if [ ! -e "$devname" ]; then
 	echo "Device $devname does not exist!"
@@ -52,8 +55,12 @@ if [ $dss_loaded -eq 0 ] ; then
 fi
 
 let "maxsidx = $stripes - 1"
+let "readahead = 2 * $chunksize"
 stripeset="`seq 0 $maxsidx`"
 dms_devs="1 $devname 0"
+if [ -n "$features" ] ; then
+	dms_devs="$dms_devs $# $features"
+fi
 
 for stripeidx in $stripeset
 do
@@ -69,6 +76,8 @@ if [ ! -b $dss_device ] ; then
 		exit 2
 	else
 		echo 'OK, size: ' `/sbin/blockdev --getsz $dss_device`
+		# target reads are strided on $devname: read ahead two whole chunks
+		/sbin/blockdev --setra $readahead $dss_device
 	fi
 else
 	echo "FAIL, device already exists!"
@@ -0,0 +1,391 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) map path microbenchmark.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the kernel address translation (dm-destripe-map.h) in userspace for
+ * every supported geometry and reports:
+ *
+ *  ns/sector : one destripe_map_sector() call on a random sector
+ *  ns/bio    : a random 1-BENCH_MAX_BIO sector bio, split at chunk boundaries
+ *              (as dm core does with max_io_len == chunk) and mapped per piece
+ *  batch map / batch unmap : ns per sector of destripe_map_sectors() and
+ *              destripe_unmap_sectors() over the whole sector array
+ *
+ * Every geometry is first verified against a naive reference mapping, so a
+ * broken fast path fails the run (exit code 1) instead of looking fast.
+ * Single index targets use a random index, multi index ones (interleaved and
+ * concatenated) the specs of bench_multi_specs[] on 8 stripes, or -i <spec>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libdestripe.h"
+
+#define BENCH_SECTORS	(1 << 22)	/* sector maps per geometry (default) */
+#define BENCH_MAX_BIO	256		/* max bio size in sectors (128KB) */
+#define BENCH_MAX_CHUNK	16384		/* largest chunk benchmarked, in sectors */
+#define BENCH_ROWS	(1 << 16)	/* target length in chunks */
+#define BENCH_VERIFY	(1 << 16)	/* sectors checked against the reference */
+
+/* Wide stripe sets benchmarked after the 2-16 range */
+static const uint32_t bench_wide_stripes[] = { 24, 32, 48, 64, 0 };
+
+/* Non power of 2 chunks benchmarked too, e.g. 384KB & 640KB RAID controller chunks */
+static const uint32_t bench_odd_chunks[] = { 24, 40, 96, 384, 768, 1280, 1536, 2560, 0 };
+
+/* Multi index targets benchmarked on BENCH_MULTI_STRIPES stripes */
+#define BENCH_MULTI_STRIPES	8
+static const char *bench_multi_specs[] = { "0,2", "1,4,6", "0+1+2", "5+3", NULL };
+
+struct bench_bio {
+	sector_t sector;
+	uint32_t len;
+};
+
+static volatile sector_t bench_sink;
+
+static uint64_t rnd_state = 0x9E3779B97F4A7C15ULL;
+
+static inline uint64_t rnd(void)
+{
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return rnd_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Naive reference: target offset to the member index & offset within its destriped device */
+static sector_t ref_member(const struct destripe_geom *g, sector_t offset, uint32_t *idx)
+{
+	sector_t chunk = offset / g->chunk_size, member;
+
+	if (g->idx.layout == DESTRIPE_LAYOUT_CONCAT) {
+		member = offset / g->member_len;
+		if (member >= g->idx.nr)
+			member = g->idx.nr - 1;
+		*idx = g->idx.idx[member];
+		return offset - member * g->member_len;
+	}
+	*idx = g->idx.idx[chunk % g->idx.nr];
+	return (chunk / g->idx.nr) * g->chunk_size + offset % g->chunk_size;
+}
+
+/* Naive reference mapping, with plain 64-bit divisions */
+static sector_t ref_map(const struct destripe_geom *g, sector_t offset)
+{
+	uint32_t idx;
+	sector_t chunk;
+
+	offset = ref_member(g, offset, &idx);
+	chunk = offset / g->chunk_size;
+	return (chunk * g->destripes + idx) * g->chunk_size + offset % g->chunk_size;
+}
+
+/* Index spec of g, for the output */
+static const char *bench_spec(const struct destripe_geom *g)
+{
+	static char buf[DESTRIPE_IDX_SPEC_MAXLEN + 1];
+
+	destripe_idx_print(&g->idx, buf, sizeof(buf));
+	return buf;
+}
+
+static sector_t bench_map_bio(const struct destripe_geom *g, const struct bench_bio *b)
+{
+	sector_t sector = b->sector, acc = 0;
+	uint32_t len = b->len, n;
+
+	while (len) {
+		n = destripe_geom_chunk_left(g, sector);
+		if (n > len)
+			n = len;
+		acc += destripe_geom_map(g, sector);
+		sector += n;
+		len -= n;
+	}
+	return acc;
+}
+
+static unsigned bench_bio_pieces(const struct destripe_geom *g, const struct bench_bio *b)
+{
+	uint32_t first = destripe_geom_chunk_left(g, b->sector);
+
+	if (b->len <= first)
+		return 1;
+	return 1 + (b->len - first + g->chunk_size - 1) / g->chunk_size;
+}
+
+/* Reference & reciprocal paths must also agree on huge sector numbers */
+static int bench_verify_large(const struct destripe_geom *g, unsigned nr)
+{
+	sector_t offset, phys, ref;
+	uint32_t idx, ref_idx;
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		offset = rnd() >> 8;	/* stays below 2^64 once multiplied by the stripes */
+		phys = rnd();
+		ref = phys / g->chunk_size;
+		ref_idx = ref % g->destripes;
+		ref = (ref / g->destripes) * g->chunk_size + phys % g->chunk_size;
+		if (destripe_map_sector(g, offset) != ref_map(g, offset) ||
+		    destripe_unmap_sector(g, phys, &idx) != ref || idx != ref_idx) {
+			fprintf(stderr, "MISMATCH: stripes=%u idx=%s chunk=%u: large sector "
+					"%llu or %llu mapped wrong\n",
+					g->destripes, bench_spec(g), g->chunk_size,
+					(unsigned long long)offset, (unsigned long long)phys);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int bench_verify(const struct destripe_geom *g, const sector_t *offs, unsigned nr)
+{
+	sector_t phys, member, batch[2];
+	uint32_t idx, ref_idx;
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		phys = destripe_map_sector(g, offs[i]);
+		member = ref_member(g, offs[i], &ref_idx);
+		destripe_map_sectors(g, &offs[i], &batch[0], 1);
+		destripe_unmap_sectors(g, &phys, &idx, &batch[1], 1);
+		if (batch[0] != phys || batch[1] != member || idx != ref_idx ||
+		    destripe_unmap_sector(g, phys, &idx) != member ||
+		    destripe_unmap_target_sector(g, phys) != offs[i]) {
+			fprintf(stderr, "MISMATCH: stripes=%u idx=%s chunk=%u sector=%llu: "
+					"batch map/unmap or unmap not the inverse of map\n",
+					g->destripes, bench_spec(g), g->chunk_size,
+					(unsigned long long)offs[i]);
+			return -1;
+		}
+		if (destripe_map_sector(g, offs[i]) != ref_map(g, offs[i])) {
+			fprintf(stderr, "MISMATCH: stripes=%u idx=%s chunk=%u sector=%llu "
+					"mapped=%llu expected=%llu\n",
+					g->destripes, bench_spec(g), g->chunk_size,
+					(unsigned long long)offs[i],
+					(unsigned long long)destripe_map_sector(g, offs[i]),
+					(unsigned long long)ref_map(g, offs[i]));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Benchmark one geometry, spec is the index spec or NULL for a random single index */
+static int bench_geom(uint32_t destripes, const char *spec, uint32_t chunk_size,
+			sector_t *offs, sector_t *out, uint32_t *idx, struct bench_bio *bios,
+			unsigned nr_sectors, unsigned nr_bios)
+{
+	struct destripe_geom g;
+	sector_t len = (sector_t)chunk_size * BENCH_ROWS, acc = 0;
+	uint64_t t0, t1, t2, t3, t4, pieces = 0;
+	char rnd_spec[12];
+	const char *err;
+	unsigned i;
+
+	if (!spec) {
+		snprintf(rnd_spec, sizeof(rnd_spec), "%u", (uint32_t)(rnd() % destripes));
+		spec = rnd_spec;
+	} else {
+		/* a whole number of chunks per member */
+		for (i = 0; spec[i]; i++)
+			if (spec[i] == ',' || spec[i] == '+')
+				len += (sector_t)chunk_size * BENCH_ROWS;
+	}
+
+	if (destripe_geom_setup_spec(&g, destripes, spec, chunk_size, len, &err)) {
+		fprintf(stderr, "stripes=%u idx=%s chunk=%u: %s\n", destripes, spec,
+			chunk_size, err);
+		return -1;
+	}
+
+	for (i = 0; i < nr_sectors; i++)
+		offs[i] = rnd() % len;
+	for (i = 0; i < nr_bios; i++) {
+		bios[i].len = 1 + rnd() % BENCH_MAX_BIO;
+		bios[i].sector = rnd() % (len - bios[i].len);
+		pieces += bench_bio_pieces(&g, &bios[i]);
+	}
+
+	if (bench_verify(&g, offs, nr_sectors < BENCH_VERIFY ? nr_sectors : BENCH_VERIFY) ||
+	    bench_verify_large(&g, BENCH_VERIFY))
+		return -1;
+
+	t0 = now_ns();
+	for (i = 0; i < nr_sectors; i++)
+		acc += destripe_map_sector(&g, offs[i]);
+	t1 = now_ns();
+	for (i = 0; i < nr_bios; i++)
+		acc += bench_map_bio(&g, &bios[i]);
+	t2 = now_ns();
+	destripe_map_sectors(&g, offs, out, nr_sectors);
+	t3 = now_ns();
+	destripe_unmap_sectors(&g, out, idx, out, nr_sectors);
+	t4 = now_ns();
+
+	bench_sink = acc + out[nr_sectors - 1] + idx[nr_sectors - 1];
+
+	printf("%7u %7s %14u %11s %10.2f %8.2f %10.2f %9.2f %11.2f\n", destripes, spec,
+		chunk_size, destripe_map_class_name(&g),
+		(double)(t1 - t0) / nr_sectors, (double)(t2 - t1) / nr_bios,
+		(double)pieces / nr_bios, (double)(t3 - t2) / nr_sectors,
+		(double)(t4 - t3) / nr_sectors);
+	return 0;
+}
+
+/* All chunk sizes (or only_chunk) for one stripe count (if it matches only_stripes) */
+static int bench_stripes(uint32_t destripes, const char *spec, uint32_t only_stripes,
+			uint32_t only_chunk, sector_t *offs, sector_t *out, uint32_t *idx,
+			struct bench_bio *bios, unsigned nr_sectors, unsigned nr_bios)
+{
+	uint32_t chunk_size;
+	const uint32_t *odd;
+	int r = 0;
+
+	if (only_stripes && destripes != only_stripes)
+		return 0;
+
+	for (chunk_size = DESTRIPE_MIN_CHUNK; chunk_size <= BENCH_MAX_CHUNK; chunk_size <<= 1) {
+		if (only_chunk && chunk_size != only_chunk)
+			continue;
+		if (bench_geom(destripes, spec, chunk_size, offs, out, idx, bios,
+				nr_sectors, nr_bios))
+			r = -1;
+	}
+	for (odd = bench_odd_chunks; *odd; odd++) {
+		if (only_chunk && *odd != only_chunk)
+			continue;
+		if (bench_geom(destripes, spec, *odd, offs, out, idx, bios, nr_sectors, nr_bios))
+			r = -1;
+	}
+	return r;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s <stripes>] [-i <index spec>] [-c <chunk size (sectors)>]"
+			" [-n <sector maps>]\n"
+			"  Benchmarks the destripe map path for every supported geometry\n"
+			"  (%u-16 stripes and some wide stripe sets up to %u, power of 2 chunks\n"
+			"  of %u-%u sectors and some common non power of 2 ones) or the given one.\n"
+			"  -i benchmarks a multi index spec (e.g. 0,2 or 0+1+2) instead of single\n"
+			"  indices, on %u stripes unless -s is given.\n",
+			prog, DESTRIPE_MIN_STRIPES, DESTRIPE_MAX_STRIPES,
+			DESTRIPE_MIN_CHUNK, BENCH_MAX_CHUNK, BENCH_MULTI_STRIPES);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t only_stripes = 0, only_chunk = 0, destripes;
+	const char *only_spec = NULL, **spec;
+	const uint32_t *wide;
+	unsigned nr_sectors = BENCH_SECTORS, nr_bios;
+	struct bench_bio *bios;
+	sector_t *offs, *out;
+	uint32_t *idx;
+	int opt, r = 0;
+
+	while ((opt = getopt(argc, argv, "s:i:c:n:h")) != -1) {
+		switch (opt) {
+		case 's':
+			only_stripes = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			only_spec = optarg;
+			break;
+		case 'c':
+			only_chunk = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nr_sectors = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (!nr_sectors) {
+		usage(argv[0]);
+		return 2;
+	}
+	nr_bios = nr_sectors / 4 ? nr_sectors / 4 : 1;
+
+	offs = malloc(sizeof(*offs) * nr_sectors);
+	out = malloc(sizeof(*out) * nr_sectors);
+	idx = malloc(sizeof(*idx) * nr_sectors);
+	bios = malloc(sizeof(*bios) * nr_bios);
+	if (!offs || !out || !idx || !bios) {
+		fprintf(stderr, "Out of memory\n");
+		return 2;
+	}
+	/* fault the output arrays in, so the first batch run is not charged for it */
+	memset(out, 0xff, sizeof(*out) * nr_sectors);
+	memset(idx, 0xff, sizeof(*idx) * nr_sectors);
+
+	printf("# destripe-bench: %u sector maps, %u bios (1-%u sectors) per geometry\n",
+		nr_sectors, nr_bios, BENCH_MAX_BIO);
+	printf("%7s %7s %14s %11s %10s %8s %10s %9s %11s\n", "stripes", "idx", "chunk(sectors)",
+		"map class", "ns/sector",
+		"ns/bio", "pieces/bio", "batch map", "batch unmap");
+
+	if (only_spec) {
+		destripes = only_stripes ? only_stripes : BENCH_MULTI_STRIPES;
+		r = bench_stripes(destripes, only_spec, 0, only_chunk, offs, out, idx, bios,
+				nr_sectors, nr_bios) ? 1 : 0;
+		goto out;
+	}
+
+	for (destripes = DESTRIPE_MIN_STRIPES; destripes <= 16; destripes++)
+		if (bench_stripes(destripes, NULL, only_stripes, only_chunk, offs, out, idx, bios,
+				nr_sectors, nr_bios))
+			r = 1;
+	for (wide = bench_wide_stripes; *wide; wide++)
+		if (bench_stripes(*wide, NULL, only_stripes, only_chunk, offs, out, idx, bios,
+				nr_sectors, nr_bios))
+			r = 1;
+	for (spec = bench_multi_specs; *spec; spec++)
+		if (bench_stripes(BENCH_MULTI_STRIPES, *spec, only_stripes, only_chunk, offs, out,
+				idx, bios, nr_sectors, nr_bios))
+			r = 1;
+out:
+
+	free(offs);
+	free(out);
+	free(idx);
+	free(bios);
+	return r;
+}
@@ -0,0 +1,590 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) offline copy engine.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Converts a striped image into its member images (destripe), or the members
+ * back into the striped image (restripe), in one sequential pass of the
+ * striped side instead of one strided dd per dss_* device:
+ *
+ *  - the striped side is copied in segments of whole stripe rows, each
+ *    segment is one large read (or a few large writes)
+ *  - the chunks of a segment are scattered to (gathered from) the members by
+ *    the target's own mapping (destripe_unmap_sectors()), one vectored I/O
+ *    per member and run of contiguous chunks
+ *  - COPY_DEPTH segments are in flight at once, on io_uring with O_DIRECT
+ *    (synchronous preadv/pwritev and buffered I/O where unavailable)
+ *  - all-zero chunks are not written: holes in regular files (created
+ *    sparse), or with -z on block devices known to read back zeroes
+ *  - with -c, the progress is checkpointed (after an fdatasync of the
+ *    outputs) and an interrupted copy resumes from there
+ *
+ * Only whole stripe rows are copied: the member length is the striped length
+ * / stripes, rounded down to a chunk, as for the dss_* devices.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#include "libdestripe.h"
+#include "destripe-ring.h"
+
+#define COPY_SEG_MB	8	/* segment size (rounded to whole stripe rows) */
+#define COPY_DEPTH	4	/* segments in flight */
+#define COPY_MAX_ROWS	IOV_MAX	/* rows per segment: one iovec per row & member */
+#define COPY_MAX_SEG_MB	1024	/* an I/O returns its length in an int, a read or
+				 * write moves at most ~2GB (MAX_RW_COUNT) */
+#define COPY_CKPT_MB	1024	/* checkpoint after at least this much copied */
+#define COPY_ALIGN	4096	/* O_DIRECT buffer alignment */
+
+enum copy_mode {
+	COPY_DESTRIPE = 0,	/* striped -> members */
+	COPY_RESTRIPE,		/* members -> striped */
+};
+
+static const char *copy_mode_names[] = { "destripe", "restripe" };
+
+/* A segment buffer */
+struct copy_buf {
+	unsigned char *data;
+	struct iovec *iov;	/* stripes * seg_rows */
+	uint64_t seg;		/* segment in it */
+	unsigned pending;	/* I/Os in flight */
+	int busy, writing;
+};
+
+struct copy {
+	enum copy_mode mode;
+	struct destripe_geom g;
+	uint32_t stripes;
+	size_t chunk_bytes;
+	int striped_fd, member_fd[DESTRIPE_MAX_STRIPES];
+	int striped_holes, member_holes;	/* zero chunks may be skipped */
+	uint64_t rows;			/* member length, in chunks */
+	uint32_t seg_rows;
+	uint64_t nr_segs, next_seg, ckpt_seg;
+	struct copy_buf buf[COPY_DEPTH];
+	sector_t *phys, *msec;		/* per chunk of a segment */
+	uint32_t *idx;
+	struct destripe_ring ring;
+	int use_ring;
+	const char *ckpt;
+	uint64_t bytes_read, bytes_written, holes;
+};
+
+static void copy_fail(const char *what, int err)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(err));
+	exit(1);
+}
+
+/*----------------------------------------------------------------- */
+
+/* Submit what is queued, waiting for min_complete completions */
+static void copy_ring_enter(struct destripe_ring *r, unsigned min_complete)
+{
+	int ret = destripe_ring_submit(r, min_complete);
+
+	if (ret < 0)
+		copy_fail("io_uring_enter", -ret);
+}
+
+/* Completions: only account them, the segments move on in copy_run() */
+static void copy_ring_done(void *priv, const struct io_uring_cqe *cqe)
+{
+	struct copy *c = priv;
+
+	if (cqe->res < 0)
+		copy_fail(copy_mode_names[c->mode], -cqe->res);
+	/* O_DIRECT chunk multiples: short means the end of a file */
+	if (cqe->res != (int)(cqe->user_data >> 8))
+		copy_fail(copy_mode_names[c->mode], EIO);
+	c->buf[cqe->user_data & 0xff].pending--;
+}
+
+static void copy_ring_reap(struct copy *c)
+{
+	destripe_ring_reap(&c->ring, copy_ring_done, c);
+}
+
+/*----------------------------------------------------------------- */
+
+/* One vectored read or write of a segment buffer */
+static void copy_io(struct copy *c, unsigned b, int write, int fd, struct iovec *iov,
+		unsigned nr, sector_t sector)
+{
+	struct destripe_ring *r = &c->ring;
+	struct io_uring_sqe *sqe;
+	size_t len = 0;
+	unsigned i;
+	ssize_t ret;
+
+	for (i = 0; i < nr; i++)
+		len += iov[i].iov_len;
+	if (write)
+		c->bytes_written += len;
+	else
+		c->bytes_read += len;
+
+	if (!c->use_ring) {
+		ret = write ? pwritev(fd, iov, nr, (off_t)sector << 9) :
+			      preadv(fd, iov, nr, (off_t)sector << 9);
+		if (ret < 0)
+			copy_fail(copy_mode_names[c->mode], errno);
+		if ((size_t)ret != len)
+			copy_fail(copy_mode_names[c->mode], EIO);
+		return;
+	}
+
+	/* enough in flight to fill the CQ: make room first (a full SQ is submitted) */
+	while (r->inflight >= r->cq_entries) {
+		copy_ring_enter(r, 1);
+		copy_ring_reap(c);
+	}
+
+	sqe = destripe_ring_sqe(r);
+	if (!sqe)
+		copy_fail("io_uring_enter", errno);
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = nr;
+	sqe->off = (uint64_t)sector << 9;
+	sqe->user_data = ((uint64_t)len << 8) | b;
+	c->buf[b].pending++;
+}
+
+static int copy_zero(const unsigned char *p, size_t len)
+{
+	static const unsigned char zero[16];
+
+	return !memcmp(p, zero, sizeof(zero)) && !memcmp(p, p + sizeof(zero), len - sizeof(zero));
+}
+
+static uint32_t copy_seg_rows(const struct copy *c, uint64_t seg)
+{
+	uint64_t left = c->rows - seg * c->seg_rows;
+
+	return left < c->seg_rows ? (uint32_t)left : c->seg_rows;
+}
+
+/*
+ * Member side of a segment: one I/O per member & run of chunks contiguous on
+ * it, zero chunks left out of the writes if holes are allowed.
+ */
+static void copy_members(struct copy *c, unsigned b, int write)
+{
+	struct copy_buf *cb = &c->buf[b];
+	uint32_t nr = copy_seg_rows(c, cb->seg) * c->stripes, used[DESTRIPE_MAX_STRIPES];
+	uint32_t start[DESTRIPE_MAX_STRIPES], k, i, m;
+	sector_t first = cb->seg * c->seg_rows * c->stripes, next[DESTRIPE_MAX_STRIPES];
+	sector_t chunk = c->g.chunk_size;
+
+	for (k = 0; k < nr; k++)
+		c->phys[k] = (first + k) * chunk;
+	destripe_unmap_sectors(&c->g, c->phys, c->idx, c->msec, nr);
+
+	memset(used, 0, sizeof(used));
+	memset(start, 0, sizeof(start));
+	for (k = 0; k <= nr; k++) {
+		/* past the last chunk: flush every member's run */
+		for (m = 0; m < c->stripes; m++) {
+			if (k < nr && m != c->idx[k])
+				continue;
+			if (used[m] > start[m] &&
+			    (k == nr || next[m] != c->msec[k] ||
+			     (write && c->member_holes &&
+			      copy_zero(cb->data + k * c->chunk_bytes, c->chunk_bytes)))) {
+				i = m * c->seg_rows + start[m];
+				copy_io(c, b, write, c->member_fd[m], &cb->iov[i], used[m] - start[m],
+					next[m] - (sector_t)(used[m] - start[m]) * chunk);
+				start[m] = used[m];
+			}
+		}
+		if (k == nr)
+			break;
+		m = c->idx[k];
+		if (write && c->member_holes &&
+		    copy_zero(cb->data + k * c->chunk_bytes, c->chunk_bytes)) {
+			c->holes++;
+			continue;
+		}
+		i = m * c->seg_rows + used[m]++;
+		cb->iov[i].iov_base = cb->data + k * c->chunk_bytes;
+		cb->iov[i].iov_len = c->chunk_bytes;
+		next[m] = c->msec[k] + chunk;
+	}
+}
+
+/* Striped side of a segment: one read, or one write per run of non-zero chunks */
+static void copy_striped(struct copy *c, unsigned b, int write)
+{
+	struct copy_buf *cb = &c->buf[b];
+	uint32_t nr = copy_seg_rows(c, cb->seg) * c->stripes, k, run = 0, n = 0;
+	sector_t first = cb->seg * c->seg_rows * c->stripes * c->g.chunk_size;
+
+	for (k = 0; k <= nr; k++) {
+		if (k < nr && !(write && c->striped_holes &&
+				copy_zero(cb->data + k * c->chunk_bytes, c->chunk_bytes)))
+			continue;
+		/* the run before chunk k (a hole, or the end) */
+		if (k > run) {
+			cb->iov[n].iov_base = cb->data + run * c->chunk_bytes;
+			cb->iov[n].iov_len = (k - run) * c->chunk_bytes;
+			copy_io(c, b, write, c->striped_fd, &cb->iov[n], 1,
+				first + (sector_t)run * c->g.chunk_size);
+			n++;
+		}
+		if (k < nr)
+			c->holes++;
+		run = k + 1;
+	}
+}
+
+/*----------------------------------------------------------------- */
+
+static int copy_ckpt_load(struct copy *c)
+{
+	unsigned stripes, seg_rows;
+	unsigned long long chunk, seg;
+	char mode[16];
+	FILE *f;
+	int n;
+
+	f = fopen(c->ckpt, "r");
+	if (!f)
+		return errno == ENOENT ? 0 : -errno;
+	n = fscanf(f, "destripe-copy %15s %u %llu %u %llu", mode, &stripes, &chunk, &seg_rows, &seg);
+	fclose(f);
+
+	if (n != 5 || strcmp(mode, copy_mode_names[c->mode]) || stripes != c->stripes ||
+	    chunk != c->g.chunk_size || seg_rows != c->seg_rows || seg > c->nr_segs) {
+		fprintf(stderr, "%s: checkpoint of another copy\n", c->ckpt);
+		exit(2);
+	}
+	c->next_seg = c->ckpt_seg = seg;
+	return 1;
+}
+
+/* Outputs on disk up to ckpt_seg first, then the checkpoint (atomically replaced) */
+static void copy_ckpt_save(struct copy *c)
+{
+	char tmp[PATH_MAX];
+	uint32_t m;
+	FILE *f;
+
+	if (c->mode == COPY_DESTRIPE) {
+		for (m = 0; m < c->stripes; m++)
+			if (fdatasync(c->member_fd[m]))
+				copy_fail("fdatasync", errno);
+	} else if (fdatasync(c->striped_fd))
+		copy_fail("fdatasync", errno);
+
+	if (!c->ckpt)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", c->ckpt);
+	f = fopen(tmp, "w");
+	if (!f)
+		copy_fail(tmp, errno);
+	fprintf(f, "destripe-copy %s %u %u %u %llu\n", copy_mode_names[c->mode], c->stripes,
+		c->g.chunk_size, c->seg_rows, (unsigned long long)c->ckpt_seg);
+	if (fflush(f) || fsync(fileno(f)) || fclose(f) || rename(tmp, c->ckpt))
+		copy_fail(c->ckpt, errno);
+}
+
+/*----------------------------------------------------------------- */
+
+/* The pipeline: reads of free buffers, writes of the read ones, checkpoints */
+static void copy_run(struct copy *c)
+{
+	uint64_t ckpt_segs = ((uint64_t)COPY_CKPT_MB << 20) /
+			((uint64_t)c->seg_rows * c->stripes * c->chunk_bytes) + 1;
+	uint64_t low;
+	unsigned b, progress;
+
+	while (c->ckpt_seg < c->nr_segs) {
+		for (b = 0; b < COPY_DEPTH && c->next_seg < c->nr_segs; b++) {
+			if (c->buf[b].busy)
+				continue;
+			c->buf[b].busy = 1;
+			c->buf[b].writing = 0;
+			c->buf[b].seg = c->next_seg++;
+			if (c->mode == COPY_DESTRIPE)
+				copy_striped(c, b, 0);
+			else
+				copy_members(c, b, 0);
+		}
+
+		if (c->use_ring && c->ring.inflight) {
+			copy_ring_enter(&c->ring, 1);
+			copy_ring_reap(c);
+		}
+
+		/* writes may all be holes: loop until nothing moves */
+		do {
+			progress = 0;
+			for (b = 0; b < COPY_DEPTH; b++) {
+				if (!c->buf[b].busy || c->buf[b].pending)
+					continue;
+				if (c->buf[b].writing) {
+					c->buf[b].busy = 0;
+					continue;
+				}
+				c->buf[b].writing = 1;
+				if (c->mode == COPY_DESTRIPE)
+					copy_members(c, b, 1);
+				else
+					copy_striped(c, b, 1);
+				progress = 1;
+			}
+		} while (progress);
+		if (c->use_ring && c->ring.to_submit)
+			copy_ring_enter(&c->ring, 0);
+
+		/* done up to the oldest segment still in a buffer */
+		low = c->next_seg;
+		for (b = 0; b < COPY_DEPTH; b++)
+			if (c->buf[b].busy && c->buf[b].seg < low)
+				low = c->buf[b].seg;
+		if (low >= c->ckpt_seg + ckpt_segs || low == c->nr_segs) {
+			c->ckpt_seg = low;
+			copy_ckpt_save(c);
+		}
+	}
+}
+
+/*----------------------------------------------------------------- */
+
+/* Size of a file or block device, and whether it may hold holes (regular file) */
+static uint64_t copy_size(int fd, const char *path, int *regular)
+{
+	uint64_t bytes;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		copy_fail(path, errno);
+	*regular = S_ISREG(st.st_mode);
+	if (*regular)
+		return st.st_size;
+	if (ioctl(fd, BLKGETSIZE64, &bytes))
+		copy_fail(path, errno);
+	return bytes;
+}
+
+/* O_DIRECT where the filesystem supports it */
+static int copy_open(const char *path, int flags)
+{
+	int fd = open(path, flags | O_DIRECT, 0644);
+
+	if (fd < 0 && errno == EINVAL)
+		fd = open(path, flags, 0644);
+	if (fd < 0)
+		copy_fail(path, errno);
+	return fd;
+}
+
+/*
+ * Output of len bytes, done up to a checkpoint: a regular file is cut at done
+ * and extended sparse, zero chunks past done can be left as holes. A block
+ * device only if it reads zeroes (-z), which an interrupted copy breaks.
+ */
+static int copy_output(int fd, const char *path, uint64_t done, uint64_t len, int zero_dev)
+{
+	uint64_t size;
+	int regular;
+
+	size = copy_size(fd, path, &regular);
+	if (regular) {
+		if (ftruncate(fd, done) || ftruncate(fd, len))
+			copy_fail(path, errno);
+		return 1;
+	}
+	if (size < len)
+		copy_fail(path, ENOSPC);
+	return zero_dev;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s destripe|restripe [-c <checkpoint file>] [-s <segment MB>] [-z]"
+			" <stripes> <chunk size (sectors)>\n"
+			"       <striped image> <member 0> ... <member stripes-1>\n"
+			"  destripe: copies the striped image to one image per stripe index, in one\n"
+			"  sequential pass; restripe: the reverse. Zero chunks become holes in regular\n"
+			"  files, and are not written to block devices with -z (known to read zeroes).\n"
+			"  With -c an interrupted copy resumes from its checkpoint. Segments of %uMB\n"
+			"  (whole stripe rows) by default, %uMB at most, %u in flight.\n",
+			prog, COPY_SEG_MB, COPY_MAX_SEG_MB, COPY_DEPTH);
+}
+
+int main(int argc, char **argv)
+{
+	struct copy *c;
+	uint64_t size, min_size = UINT64_MAX, row_bytes, seg_mb = COPY_SEG_MB;
+	int opt, zero_devs = 0, regular, resume;
+	struct timespec t0, t1;
+	const char *err;
+	unsigned b, chunk;
+	uint32_t m;
+	double secs;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		fprintf(stderr, "Out of memory\n");
+		return 2;
+	}
+	if (argc < 2 || (strcmp(argv[1], "destripe") && strcmp(argv[1], "restripe"))) {
+		usage(argv[0]);
+		return 2;
+	}
+	c->mode = strcmp(argv[1], "destripe") ? COPY_RESTRIPE : COPY_DESTRIPE;
+
+	/* options after the command */
+	argv[1] = argv[0];
+	argc--;
+	argv++;
+	while ((opt = getopt(argc, argv, "c:s:zh")) != -1) {
+		switch (opt) {
+		case 'c':
+			c->ckpt = optarg;
+			break;
+		case 's':
+			seg_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			zero_devs = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (argc - optind < 3 || !seg_mb) {
+		usage(argv[0]);
+		return 2;
+	}
+	c->stripes = strtoul(argv[optind++], NULL, 10);
+	chunk = strtoul(argv[optind++], NULL, 10);
+	if (destripe_geom_setup(&c->g, c->stripes, 0, chunk, &err)) {
+		fprintf(stderr, "%s\n", err);
+		return 2;
+	}
+	if ((uint32_t)(argc - optind) != c->stripes + 1) {
+		fprintf(stderr, "Need the striped image and %u member images\n", c->stripes);
+		return 2;
+	}
+	c->chunk_bytes = (size_t)chunk << 9;
+	row_bytes = c->chunk_bytes * c->stripes;
+	/* the striped side of a segment is a single I/O, so is a whole row */
+	if (row_bytes > (uint64_t)COPY_MAX_SEG_MB << 20) {
+		fprintf(stderr, "Stripe row larger than %u MB\n", COPY_MAX_SEG_MB);
+		return 2;
+	}
+	if (seg_mb > COPY_MAX_SEG_MB)
+		seg_mb = COPY_MAX_SEG_MB;
+	c->seg_rows = (seg_mb << 20) / row_bytes ? (seg_mb << 20) / row_bytes : 1;
+	if (c->seg_rows > COPY_MAX_ROWS)
+		c->seg_rows = COPY_MAX_ROWS;
+
+	/* sizes: the member length is a whole number of chunks, as for dss_* devices */
+	if (c->mode == COPY_DESTRIPE) {
+		c->striped_fd = copy_open(argv[optind], O_RDONLY);
+		c->rows = copy_size(c->striped_fd, argv[optind], &regular) / row_bytes;
+	} else {
+		for (m = 0; m < c->stripes; m++) {
+			c->member_fd[m] = copy_open(argv[optind + 1 + m], O_RDONLY);
+			size = copy_size(c->member_fd[m], argv[optind + 1 + m], &regular);
+			if (size < min_size)
+				min_size = size;
+		}
+		c->rows = min_size / c->chunk_bytes;
+	}
+	if (!c->rows) {
+		fprintf(stderr, "Nothing to copy: smaller than a stripe row\n");
+		return 2;
+	}
+	c->nr_segs = (c->rows + c->seg_rows - 1) / c->seg_rows;
+	resume = c->ckpt && copy_ckpt_load(c) > 0;
+
+	/* outputs: sparse, with what is left to copy (all of it unless resuming) cut off */
+	if (c->mode == COPY_DESTRIPE) {
+		c->member_holes = 1;
+		for (m = 0; m < c->stripes; m++) {
+			c->member_fd[m] = copy_open(argv[optind + 1 + m], O_WRONLY | O_CREAT);
+			c->member_holes &= copy_output(c->member_fd[m], argv[optind + 1 + m],
+				c->ckpt_seg * c->seg_rows * c->chunk_bytes, c->rows * c->chunk_bytes,
+				zero_devs && !resume);
+		}
+	} else {
+		c->striped_fd = copy_open(argv[optind], O_WRONLY | O_CREAT);
+		c->striped_holes = copy_output(c->striped_fd, argv[optind],
+			c->ckpt_seg * c->seg_rows * row_bytes, c->rows * row_bytes,
+			zero_devs && !resume);
+	}
+
+	for (b = 0; b < COPY_DEPTH; b++) {
+		if (posix_memalign((void **)&c->buf[b].data, COPY_ALIGN, c->seg_rows * row_bytes))
+			copy_fail("segment buffers", ENOMEM);
+		c->buf[b].iov = calloc((size_t)c->seg_rows * c->stripes, sizeof(struct iovec));
+		if (!c->buf[b].iov)
+			copy_fail("segment buffers", ENOMEM);
+	}
+	c->phys = calloc((size_t)c->seg_rows * c->stripes, sizeof(sector_t));
+	c->msec = calloc((size_t)c->seg_rows * c->stripes, sizeof(sector_t));
+	c->idx = calloc((size_t)c->seg_rows * c->stripes, sizeof(uint32_t));
+	if (!c->phys || !c->msec || !c->idx)
+		copy_fail("segment maps", ENOMEM);
+
+	/* a read or write per member & segment in flight, at most */
+	c->use_ring = !destripe_ring_init(&c->ring, COPY_DEPTH * (c->stripes + 1), 0);
+	if (!c->use_ring)
+		fprintf(stderr, "io_uring unavailable, synchronous I/O\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	copy_run(c);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	/* finished: the checkpoint has nothing left to resume */
+	if (c->ckpt && unlink(c->ckpt) && errno != ENOENT)
+		copy_fail(c->ckpt, errno);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%s: %u stripes x %llu chunks of %u sectors%s, read %llu MB, wrote %llu MB,"
+		" %llu zero chunks skipped, %.1f s (%.1f MB/s)\n", copy_mode_names[c->mode],
+		c->stripes, (unsigned long long)c->rows, chunk, resume ? " (resumed)" : "",
+		(unsigned long long)(c->bytes_read >> 20),
+		(unsigned long long)(c->bytes_written >> 20), (unsigned long long)c->holes,
+		secs, secs > 0 ? (c->bytes_read >> 20) / secs : 0.0);
+	return 0;
+}
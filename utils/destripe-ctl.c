@@ -0,0 +1,282 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) sibling set control tool.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Creates (or removes) the whole sibling set of destripe devices of one or
+ * more striped disks, one device per stripe index, in a single process:
+ *
+ *  - the geometry is validated once, with the destripe_ctr() checks
+ *  - each device is created, loaded & resumed by libdevmapper directly, no
+ *    dmsetup process per device and no sync/udevadm settle in between
+ *  - all the devices share one udev cookie: udev handles their events in
+ *    parallel and we wait once, for all of them, at the end
+ *
+ * Device names are those of the scripts: dss_<disk><idx> as created by
+ * scripts/destripe_device_create.sh, or <name>_<idx> with -n (a single disk,
+ * as scripts/mkalldevs_dm_destripe.sh). A disk whose set fails to come up
+ * completely is rolled back, the other disks go on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <libdevmapper.h>
+
+#include "libdestripe.h"
+
+#define CTL_TARGET		"destripe"
+#define CTL_MAX_FEATURES	8	/* -f options */
+#define CTL_PARAMS_LEN		(PATH_MAX + 256)
+
+struct ctl_opts {
+	const char *name;		/* -n: device names <name>_<idx> */
+	const char *features[CTL_MAX_FEATURES];
+	unsigned nr_features;
+	uint32_t destripes;
+	uint32_t chunk_size;		/* sectors */
+};
+
+static void ctl_dev_name(const struct ctl_opts *o, const char *disk, uint32_t idx,
+			char *buf, size_t len)
+{
+	const char *base = strrchr(disk, '/');
+
+	if (o->name)
+		snprintf(buf, len, "%s_%u", o->name, idx);
+	else
+		snprintf(buf, len, "dss_%s%u", base ? base + 1 : disk, idx);
+}
+
+static int ctl_disk_sectors(const char *disk, uint64_t *sectors)
+{
+	uint64_t bytes;
+	int fd, r;
+
+	fd = open(disk, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	r = ioctl(fd, BLKGETSIZE64, &bytes) ? -errno : 0;
+	close(fd);
+
+	*sectors = bytes >> 9;
+	return r;
+}
+
+/*
+ * One dm ioctl, its udev event counted on *cookie (created by the first task).
+ * Returns 0, or the -errno of the ioctl (-1 if it did not get that far).
+ */
+static int ctl_task(int type, const char *name, uint64_t len, const char *params,
+		uint32_t read_ahead, uint32_t *cookie)
+{
+	struct dm_task *dmt;
+	int r = -1;
+
+	dmt = dm_task_create(type);
+	if (!dmt)
+		return -1;
+
+	if (!dm_task_set_name(dmt, name))
+		goto out;
+	if (params && !dm_task_add_target(dmt, 0, len, CTL_TARGET, params))
+		goto out;
+	if (read_ahead && !dm_task_set_read_ahead(dmt, read_ahead, DM_READ_AHEAD_MINIMUM_FLAG))
+		goto out;
+	/* an opener racing with us (udev's blkid) makes the remove retry */
+	if (type == DM_DEVICE_REMOVE && !dm_task_retry_remove(dmt))
+		goto out;
+	if (!dm_task_set_cookie(dmt, cookie, 0))
+		goto out;
+
+	if (dm_task_run(dmt))
+		r = 0;
+	else if (dm_task_get_errno(dmt))
+		r = -dm_task_get_errno(dmt);
+out:
+	dm_task_destroy(dmt);
+	return r;
+}
+
+/* Create, load & resume the sibling set of a disk; all or nothing */
+static int ctl_create_disk(const struct ctl_opts *o, const char *disk, uint32_t *cookie)
+{
+	char name[DM_NAME_LEN], params[CTL_PARAMS_LEN];
+	uint64_t sectors = 0, len;
+	uint32_t idx;
+	int n, r;
+	unsigned f;
+
+	r = ctl_disk_sectors(disk, &sectors);
+	if (r) {
+		fprintf(stderr, "%s: %s\n", disk, strerror(-r));
+		return -1;
+	}
+
+	/* each sibling gets the same whole number of chunks, the tail is left out */
+	len = sectors / o->destripes / o->chunk_size * o->chunk_size;
+	if (!len) {
+		fprintf(stderr, "%s: smaller than a stripe row\n", disk);
+		return -1;
+	}
+
+	for (idx = 0; idx < o->destripes; idx++) {
+		n = snprintf(params, sizeof(params), "%u %u %u 1 %s 0",
+			o->destripes, idx, o->chunk_size, disk);
+		if (o->nr_features) {
+			n += snprintf(params + n, sizeof(params) - n, " %u", o->nr_features);
+			for (f = 0; f < o->nr_features; f++)
+				n += snprintf(params + n, sizeof(params) - n, " %s",
+					o->features[f]);
+		}
+		ctl_dev_name(o, disk, idx, name, sizeof(name));
+
+		/* strided reads of the disk: read ahead two chunks (as the scripts) */
+		if (ctl_task(DM_DEVICE_CREATE, name, len, params, 2 * o->chunk_size, cookie)) {
+			fprintf(stderr, "%s: failed to create %s, removing the set\n", disk, name);
+			while (idx--) {
+				ctl_dev_name(o, disk, idx, name, sizeof(name));
+				ctl_task(DM_DEVICE_REMOVE, name, 0, NULL, 0, cookie);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Remove the sibling set of a disk, as much of it as exists */
+static int ctl_remove_disk(const struct ctl_opts *o, const char *disk, uint32_t *cookie)
+{
+	char name[DM_NAME_LEN];
+	uint32_t idx;
+	int r = 0, e;
+
+	/* a set left partial (failed create, removed by hand): its holes are no error */
+	for (idx = 0; idx < o->destripes; idx++) {
+		ctl_dev_name(o, disk, idx, name, sizeof(name));
+		e = ctl_task(DM_DEVICE_REMOVE, name, 0, NULL, 0, cookie);
+		if (e && e != -ENXIO) {
+			fprintf(stderr, "%s: failed to remove %s\n", disk, name);
+			r = -1;
+		}
+	}
+	return r;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s create [-n <name>] [-f <feature>]... <stripes> <chunk size (sectors)>"
+			" <disk>...\n"
+			"       %s remove [-n <name>] <stripes> <disk>...\n"
+			"  Creates (or removes) one destripe device per stripe index of each striped\n"
+			"  disk, named dss_<disk><idx>, or <name>_<idx> with -n (a single disk).\n"
+			"  -f adds a feature to the tables (e.g. row_reads), up to %u.\n",
+			prog, prog, CTL_MAX_FEATURES);
+}
+
+int main(int argc, char **argv)
+{
+	struct ctl_opts o = { .name = NULL };
+	struct destripe_geom g;
+	unsigned done = 0, nr_disks;
+	uint32_t cookie = 0;
+	const char *err;
+	int create, opt, i, r = 0;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (!strcmp(argv[1], "create"))
+		create = 1;
+	else if (!strcmp(argv[1], "remove"))
+		create = 0;
+	else {
+		usage(argv[0]);
+		return 2;
+	}
+
+	/* options after the command */
+	argv[1] = argv[0];
+	argc--;
+	argv++;
+	while ((opt = getopt(argc, argv, create ? "n:f:h" : "n:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			o.name = optarg;
+			break;
+		case 'f':
+			if (o.nr_features == CTL_MAX_FEATURES) {
+				fprintf(stderr, "Too many features (max %u)\n", CTL_MAX_FEATURES);
+				return 2;
+			}
+			o.features[o.nr_features++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (argc - optind < (create ? 3 : 2)) {
+		usage(argv[0]);
+		return 2;
+	}
+	o.destripes = strtoul(argv[optind++], NULL, 10);
+	if (create)
+		o.chunk_size = strtoul(argv[optind++], NULL, 10);
+	nr_disks = argc - optind;
+	if (o.name && nr_disks > 1) {
+		fprintf(stderr, "-n names the devices of a single disk\n");
+		return 2;
+	}
+
+	/* once for all the disks, with the same checks as the target */
+	if (destripe_geom_setup(&g, o.destripes, 0, create ? o.chunk_size : DESTRIPE_MIN_CHUNK,
+				&err)) {
+		fprintf(stderr, "%s\n", err);
+		return 2;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if ((create ? ctl_create_disk : ctl_remove_disk)(&o, argv[i], &cookie))
+			r = 1;
+		else
+			done++;
+	}
+
+	/* the udev events of all the devices, at once */
+	if (cookie && !dm_udev_wait(cookie))
+		r = 1;
+	dm_lib_release();
+
+	printf("%s %u of %u disks (%u devices each)\n", create ? "Created" : "Removed",
+		done, nr_disks, o.destripes);
+	return r;
+}
@@ -0,0 +1,165 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) userspace tools io_uring.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "destripe-ring.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#define __NR_io_uring_enter	426
+#define __NR_io_uring_register	427
+#endif
+
+int destripe_ring_init(struct destripe_ring *r, unsigned entries, unsigned flags)
+{
+	struct io_uring_params p;
+	size_t sqes_len;
+	void *sq, *cq;
+	int err;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+	r->sqe_shift = flags & IORING_SETUP_SQE128 ? 7 : 6;
+	sqes_len = (size_t)p.sq_entries << r->sqe_shift;
+
+	r->sqes = r->cq_ring = MAP_FAILED;
+	sq = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	r->sq_ring = cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail_sq;
+		r->cq_ring = cq;
+	}
+	r->sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	r->sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+	r->cq_entries = p.cq_entries;
+	r->to_submit = r->inflight = 0;
+	return 0;
+
+fail_cq:
+	if (r->cq_ring != MAP_FAILED)
+		munmap(r->cq_ring, r->cq_len);
+fail_sq:
+	munmap(sq, r->sq_len);
+fail:
+	err = -errno;
+	close(r->fd);
+	return err;
+}
+
+void destripe_ring_exit(struct destripe_ring *r)
+{
+	munmap(r->sqes, (size_t)r->sq_entries << r->sqe_shift);
+	if (r->cq_ring != MAP_FAILED)
+		munmap(r->cq_ring, r->cq_len);
+	munmap(r->sq_ring, r->sq_len);
+	close(r->fd);
+}
+
+struct io_uring_sqe *destripe_ring_sqe(struct destripe_ring *r)
+{
+	unsigned tail = *r->sq_tail, i = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) {
+		ret = destripe_ring_submit(r, 0);
+		if (ret <= 0) {
+			errno = ret ? -ret : EBUSY;
+			return NULL;
+		}
+	}
+
+	sqe = (struct io_uring_sqe *)((char *)r->sqes + ((size_t)i << r->sqe_shift));
+	memset(sqe, 0, (size_t)1 << r->sqe_shift);
+	r->sq_array[i] = i;
+	/* the kernel reads the SQE only once the tail moves past it */
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+	r->inflight++;
+	return sqe;
+}
+
+int destripe_ring_submit(struct destripe_ring *r, unsigned wait_nr)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	r->to_submit -= ret;
+	return ret;
+}
+
+unsigned destripe_ring_reap(struct destripe_ring *r,
+			void (*fn)(void *priv, const struct io_uring_cqe *cqe), void *priv)
+{
+	unsigned head = *r->cq_head, tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned nr = tail - head;
+
+	for (; head != tail; head++) {
+		r->inflight--;
+		fn(priv, &r->cqes[head & *r->cq_mask]);
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return nr;
+}
+
+int destripe_ring_register(struct destripe_ring *r, unsigned opcode, const void *arg,
+			unsigned nr)
+{
+	return syscall(__NR_io_uring_register, r->fd, opcode, arg, nr) < 0 ? -errno : 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) userspace tools io_uring.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DESTRIPE_RING_H
+#define _DESTRIPE_RING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring on the raw syscalls, so that the tools need no liburing.
+ * One ring per thread: nothing here is locked.
+ */
+struct destripe_ring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void *sqes;			/* 64 or 128 (IORING_SETUP_SQE128) bytes each */
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries, cq_entries, sqe_shift;
+	unsigned to_submit;		/* queued, not yet submitted */
+	unsigned inflight;		/* submitted or queued, not yet reaped */
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len;
+};
+
+/* Set up a ring of at least entries SQEs. Returns 0 or -errno. */
+int destripe_ring_init(struct destripe_ring *r, unsigned entries, unsigned flags);
+void destripe_ring_exit(struct destripe_ring *r);
+
+/*
+ * Next SQE, zeroed, counted as queued & in flight. A full SQ is submitted
+ * first; NULL if that fails (errno set).
+ */
+struct io_uring_sqe *destripe_ring_sqe(struct destripe_ring *r);
+
+/* Submit the queued SQEs, waiting for wait_nr completions. Returns >= 0 or -errno. */
+int destripe_ring_submit(struct destripe_ring *r, unsigned wait_nr);
+
+/* Pass each available CQE to fn, returns how many */
+unsigned destripe_ring_reap(struct destripe_ring *r,
+			void (*fn)(void *priv, const struct io_uring_cqe *cqe), void *priv);
+
+/* io_uring_register() (fixed files & buffers). Returns 0 or -errno. */
+int destripe_ring_register(struct destripe_ring *r, unsigned opcode, const void *arg,
+			unsigned nr);
+
+#endif /* _DESTRIPE_RING_H */
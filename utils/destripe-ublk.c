@@ -0,0 +1,788 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) ublk userspace server.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Serves a destripe target from userspace, as a ublk block device
+ * (/dev/ublkb<N>, Linux 6.0+ with CONFIG_BLK_DEV_UBLK), for hosts where the
+ * module cannot be loaded and as a test bed for I/O policies:
+ *
+ *  - the arguments are the destripe_ctr() table arguments, checked and
+ *    mapped with the target's own code (dm-destripe-map.h via libdestripe)
+ *  - one thread & io_uring per ublk queue: the ublk commands and the I/O to
+ *    the striped devices share the ring, all that a batch of completions
+ *    queues is submitted by a single io_uring_enter()
+ *  - requests are split at chunk boundaries and the pieces physically
+ *    contiguous on a device merged back, as destripe_dax_map() does
+ *  - the request buffers are registered with the ring (fixed buffers) and the
+ *    devices (fixed files), opened O_DIRECT
+ *
+ * ublk copies the data between the request and our buffers; the per request
+ * zero copy of newer kernels (UBLK_F_SUPPORT_ZERO_COPY) is not used, it needs
+ * buffer registration commands that <linux/ublk_cmd.h> does not have here.
+ * The table features are those of the kernel target: only split_bios (which
+ * is what we always do) is accepted.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/ublk_cmd.h>
+
+#include "libdestripe.h"
+#include "destripe-ring.h"
+
+#define SRV_CTRL_DEV	"/dev/ublk-control"
+#define SRV_CDEV	"/dev/ublkc%d"
+#define SRV_MAX_DEVS	256		/* as DESTRIPE_MAX_DEVS */
+#define SRV_MAX_QUEUES	64
+#define SRV_DEPTH	128		/* requests per queue (default) */
+#define SRV_BUF_BYTES	(512 << 10)	/* max request size */
+#define SRV_CDEV_WAIT	100		/* tries (10ms apart) for udev to create the cdev */
+
+/* user_data: tag, whether it is the tag's ublk command, bytes expected back */
+#define SRV_TAG_MASK	0xffffULL
+#define SRV_UBLK_CMD	(1ULL << 16)
+#define SRV_BYTES_SHIFT	32
+#define SRV_STOP	(1ULL << 17)	/* the stop eventfd poll */
+#define SRV_DISCARD	(1ULL << 18)	/* a discard: a device without any is no error */
+
+/* Only split_bios: the other features are kernel target caches & write back */
+static const char *srv_feature_names[] = {
+	"split_bios", "prefetch", "cache", "row_reads", "write_back",
+};
+
+/* A striped device: source sectors from source_start, on it from physical_start */
+struct srv_dev {
+	const char *path;
+	int fd;
+	uint64_t physical_start, source_start, source_secs;
+	int bdev;		/* a block device, not a regular file */
+};
+
+struct srv_io {
+	unsigned char *buf;
+	unsigned pending;	/* device I/Os in flight */
+	int result;		/* for the commit: bytes or -errno */
+};
+
+struct srv_queue {
+	struct srv *s;
+	unsigned q_id;
+	pthread_t thread;
+	struct destripe_ring ring;
+	struct ublksrv_io_desc *iods;	/* the requests, shared with the driver */
+	size_t iods_len;
+	struct srv_io *io;
+	unsigned char *bufs;
+	int fixed_bufs;
+	unsigned live;			/* tags not aborted yet */
+	unsigned serving;		/* tags fetched, not committed yet */
+	int stopping, err;
+};
+
+struct srv {
+	struct destripe_geom g;
+	struct srv_dev dev[SRV_MAX_DEVS];
+	unsigned nr_devs;
+	uint64_t target_len;
+	unsigned nr_queues, depth;
+	int ctrl_fd, cdev_fd, stop_fd;
+	struct destripe_ring ctrl;
+	struct ublksrv_ctrl_dev_info info;
+	struct srv_queue queue[SRV_MAX_QUEUES];
+	pthread_barrier_t started;
+	int failed;
+};
+
+/*----------------------------------------------------------------- */
+
+/* The device holding a source sector (as destripe_map_dev()) */
+static struct srv_dev *srv_map_dev(struct srv *s, uint64_t phys)
+{
+	unsigned lo = 0, hi = s->nr_devs - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) >> 1;
+		if (s->dev[mid].source_start <= phys)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &s->dev[lo];
+}
+
+static void srv_ctrl_done(void *priv, const struct io_uring_cqe *cqe)
+{
+	*(int *)priv = cqe->res;
+}
+
+/* One control command on /dev/ublk-control, synchronously */
+static int srv_ctrl(struct srv *s, unsigned op, void *buf, unsigned len, uint64_t data)
+{
+	struct ublksrv_ctrl_cmd *cmd;
+	struct io_uring_sqe *sqe;
+	int r;
+
+	sqe = destripe_ring_sqe(&s->ctrl);
+	if (!sqe)
+		return -errno;
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = s->ctrl_fd;
+	sqe->cmd_op = op;
+	cmd = (struct ublksrv_ctrl_cmd *)sqe->cmd;
+	cmd->dev_id = s->info.dev_id;
+	cmd->queue_id = (__u16)-1;
+	cmd->addr = (unsigned long)buf;
+	cmd->len = len;
+	cmd->data[0] = data;
+
+	r = destripe_ring_submit(&s->ctrl, 1);
+	if (r < 0)
+		return r;
+	destripe_ring_reap(&s->ctrl, srv_ctrl_done, &r);
+	return r;
+}
+
+/*----------------------------------------------------------------- */
+
+/* Give the tag back to the driver: the result of its request & fetch the next */
+static void srv_commit(struct srv_queue *q, unsigned tag, unsigned op, int result)
+{
+	struct ublksrv_io_cmd *cmd;
+	struct io_uring_sqe *sqe;
+
+	sqe = destripe_ring_sqe(&q->ring);
+	if (!sqe) {
+		q->err = -errno;
+		return;
+	}
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = 0;			/* the cdev, fixed file 0 */
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->cmd_op = op;
+	cmd = (struct ublksrv_io_cmd *)sqe->cmd;
+	cmd->q_id = q->q_id;
+	cmd->tag = tag;
+	cmd->result = result;
+	cmd->addr = (unsigned long)q->io[tag].buf;
+	sqe->user_data = tag | SRV_UBLK_CMD;
+	if (op == UBLK_IO_COMMIT_AND_FETCH_REQ)
+		q->serving--;
+}
+
+/* One I/O of a request to a striped device (fixed file 1 + device index) */
+static void srv_dev_io(struct srv_queue *q, unsigned tag, unsigned op, unsigned flags,
+		struct srv_dev *d, uint64_t sector, uint32_t sectors, uint64_t buf_off)
+{
+	struct srv_io *io = &q->io[tag];
+	struct io_uring_sqe *sqe;
+	uint64_t bytes = (uint64_t)sectors << 9;
+
+	sqe = destripe_ring_sqe(&q->ring);
+	if (!sqe) {
+		io->result = -errno;
+		return;
+	}
+	sqe->fd = 1 + (d - q->s->dev);
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->off = sector << 9;
+	sqe->user_data = tag;
+
+	switch (op) {
+	case UBLK_IO_OP_READ:
+	case UBLK_IO_OP_WRITE:
+		if (q->fixed_bufs) {
+			sqe->opcode = op == UBLK_IO_OP_READ ? IORING_OP_READ_FIXED :
+							      IORING_OP_WRITE_FIXED;
+			sqe->buf_index = tag;
+		} else
+			sqe->opcode = op == UBLK_IO_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+		sqe->addr = (unsigned long)(io->buf + buf_off);
+		sqe->len = bytes;
+		if (flags & UBLK_IO_F_FUA)
+			sqe->rw_flags = RWF_DSYNC;
+		sqe->user_data |= bytes << SRV_BYTES_SHIFT;
+		break;
+	/*
+	 * The offset in off, the length in addr & the mode in len. On a block
+	 * device a hole punch is a zeroout, NO_HIDE_STALE makes it a discard.
+	 */
+	case UBLK_IO_OP_DISCARD:
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->addr = bytes;
+		sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+		if (d->bdev)
+			sqe->len |= FALLOC_FL_NO_HIDE_STALE;
+		sqe->user_data |= SRV_DISCARD;
+		break;
+	case UBLK_IO_OP_WRITE_ZEROES:
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->addr = bytes;
+		sqe->len = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+		break;
+	}
+	io->pending++;
+}
+
+/*
+ * Map a request chunk by chunk, merging the pieces contiguous on a device
+ * (consecutive chunks of the same stripe index on a 1 stripe source...).
+ */
+static void srv_map(struct srv_queue *q, unsigned tag, unsigned op, unsigned flags,
+		uint64_t sector, uint32_t nr)
+{
+	struct srv *s = q->s;
+	struct srv_dev *d, *run_dev = NULL;
+	uint64_t phys, dev_sec, run_sec = 0;
+	uint32_t len, done = 0, run_len = 0, run_off = 0;
+
+	while (done < nr) {
+		len = destripe_geom_chunk_left(&s->g, sector + done);
+		if (len > nr - done)
+			len = nr - done;
+		phys = destripe_map_sector(&s->g, sector + done);
+		d = srv_map_dev(s, phys);
+		dev_sec = phys - d->source_start + d->physical_start;
+
+		if (run_len && d == run_dev && dev_sec == run_sec + run_len) {
+			run_len += len;
+		} else {
+			if (run_len)
+				srv_dev_io(q, tag, op, flags, run_dev, run_sec, run_len,
+					(uint64_t)run_off << 9);
+			run_dev = d;
+			run_sec = dev_sec;
+			run_len = len;
+			run_off = done;
+		}
+		done += len;
+	}
+	if (run_len)
+		srv_dev_io(q, tag, op, flags, run_dev, run_sec, run_len, (uint64_t)run_off << 9);
+}
+
+/* A request fetched: queue its device I/Os, or commit it right away */
+static void srv_handle(struct srv_queue *q, unsigned tag)
+{
+	const struct ublksrv_io_desc *iod = &q->iods[tag];
+	struct srv_io *io = &q->io[tag];
+	struct io_uring_sqe *sqe;
+	unsigned op = ublksrv_get_op(iod), i;
+
+	q->serving++;
+	io->pending = 0;
+	io->result = 0;
+
+	switch (op) {
+	case UBLK_IO_OP_READ:
+	case UBLK_IO_OP_WRITE:
+		io->result = iod->nr_sectors << 9;
+		/* fall through */
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		if (iod->start_sector + iod->nr_sectors > q->s->target_len) {
+			io->result = -EIO;
+			break;
+		}
+		srv_map(q, tag, op, ublksrv_get_flags(iod), iod->start_sector, iod->nr_sectors);
+		break;
+	case UBLK_IO_OP_FLUSH:
+		for (i = 0; i < q->s->nr_devs; i++) {
+			sqe = destripe_ring_sqe(&q->ring);
+			if (!sqe) {
+				io->result = -errno;
+				break;
+			}
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = 1 + i;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe->user_data = tag;
+			io->pending++;
+		}
+		break;
+	default:
+		io->result = -EOPNOTSUPP;
+	}
+
+	if (!io->pending)
+		srv_commit(q, tag, UBLK_IO_COMMIT_AND_FETCH_REQ, io->result);
+}
+
+static void srv_queue_done(void *priv, const struct io_uring_cqe *cqe)
+{
+	struct srv_queue *q = priv;
+	unsigned tag = cqe->user_data & SRV_TAG_MASK;
+	uint32_t bytes = cqe->user_data >> SRV_BYTES_SHIFT;
+	struct srv_io *io = &q->io[tag];
+
+	if (cqe->user_data == SRV_STOP) {
+		q->stopping = 1;
+		return;
+	}
+	if (cqe->user_data & SRV_UBLK_CMD) {
+		if (cqe->res == UBLK_IO_RES_OK) {
+			srv_handle(q, tag);
+			return;
+		}
+		/* the device is stopping (or broken): no more requests on this tag */
+		if (cqe->res != UBLK_IO_RES_ABORT)
+			q->err = cqe->res < 0 ? cqe->res : -EPROTO;
+		q->live--;
+		return;
+	}
+
+	if (cqe->res == -EOPNOTSUPP && (cqe->user_data & SRV_DISCARD))
+		;	/* a discard is a hint */
+	else if (cqe->res < 0)
+		io->result = cqe->res;
+	else if (bytes && (uint32_t)cqe->res != bytes && io->result >= 0)
+		io->result = -EIO;
+	if (!--io->pending)
+		srv_commit(q, tag, UBLK_IO_COMMIT_AND_FETCH_REQ, io->result);
+}
+
+/*----------------------------------------------------------------- */
+
+static int srv_queue_setup(struct srv_queue *q)
+{
+	struct srv *s = q->s;
+	long page = sysconf(_SC_PAGESIZE);
+	int fds[1 + SRV_MAX_DEVS];
+	struct iovec *iov;
+	unsigned tag, i;
+	off_t off;
+	int r;
+
+	/* the request descriptors of queue q_id, each queue at a max depth stride */
+	q->iods_len = (q->s->depth * sizeof(struct ublksrv_io_desc) + page - 1) & ~(page - 1);
+	off = UBLKSRV_CMD_BUF_OFFSET + q->q_id *
+		((UBLK_MAX_QUEUE_DEPTH * sizeof(struct ublksrv_io_desc) + page - 1) & ~(page - 1));
+	q->iods = mmap(NULL, q->iods_len, PROT_READ, MAP_SHARED | MAP_POPULATE, s->cdev_fd, off);
+	if (q->iods == MAP_FAILED)
+		return -errno;
+
+	q->io = calloc(s->depth, sizeof(*q->io));
+	iov = calloc(s->depth, sizeof(*iov));
+	if (!q->io || !iov ||
+	    posix_memalign((void **)&q->bufs, page, (size_t)s->depth * SRV_BUF_BYTES)) {
+		free(iov);
+		return -ENOMEM;
+	}
+	for (tag = 0; tag < s->depth; tag++) {
+		q->io[tag].buf = q->bufs + (size_t)tag * SRV_BUF_BYTES;
+		iov[tag].iov_base = q->io[tag].buf;
+		iov[tag].iov_len = SRV_BUF_BYTES;
+	}
+
+	/* a command & up to a piece per chunk of its request in flight per tag */
+	r = destripe_ring_init(&q->ring, 2 * s->depth, 0);
+	if (r) {
+		free(iov);
+		return r;
+	}
+
+	fds[0] = s->cdev_fd;
+	for (i = 0; i < s->nr_devs; i++)
+		fds[1 + i] = s->dev[i].fd;
+	r = destripe_ring_register(&q->ring, IORING_REGISTER_FILES, fds, 1 + s->nr_devs);
+	if (r) {
+		free(iov);
+		return r;
+	}
+
+	/* pinned memory, RLIMIT_MEMLOCK on older kernels: plain reads & writes then */
+	q->fixed_bufs = !destripe_ring_register(&q->ring, IORING_REGISTER_BUFFERS, iov, s->depth);
+	if (!q->fixed_bufs && !q->q_id)
+		fprintf(stderr, "Fixed buffers unavailable (RLIMIT_MEMLOCK?), not registered\n");
+	free(iov);
+	return 0;
+}
+
+static void *srv_queue_run(void *arg)
+{
+	struct srv_queue *q = arg;
+	struct srv *s = q->s;
+	struct io_uring_sqe *sqe;
+	unsigned tag;
+	int r;
+
+	q->err = srv_queue_setup(q);
+	if (q->err)
+		__atomic_store_n(&s->failed, 1, __ATOMIC_RELEASE);
+	pthread_barrier_wait(&s->started);
+	if (__atomic_load_n(&s->failed, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* START_DEV waits for a fetch on every tag of every queue */
+	for (tag = 0; tag < s->depth; tag++)
+		srv_commit(q, tag, UBLK_IO_FETCH_REQ, 0);
+	q->live = s->depth;
+
+	/* woken up by main() once the device is stopped */
+	sqe = destripe_ring_sqe(&q->ring);
+	if (!sqe) {
+		q->err = -errno;
+		return NULL;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = s->stop_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = SRV_STOP;
+
+	/*
+	 * Until the driver aborts all the tags, or we are stopped with none
+	 * being served: closing the ring cancels the fetches left then.
+	 */
+	while (q->live && !(q->stopping && !q->serving)) {
+		r = destripe_ring_submit(&q->ring, 1);
+		if (r < 0) {
+			q->err = r;
+			break;
+		}
+		destripe_ring_reap(&q->ring, srv_queue_done, q);
+	}
+	destripe_ring_exit(&q->ring);
+	return NULL;
+}
+
+/*----------------------------------------------------------------- */
+
+static int srv_set_params(struct srv *s)
+{
+	struct ublk_params p;
+	uint32_t chunk = s->g.chunk_size, max_sectors = SRV_BUF_BYTES >> 9;
+	uint64_t io_opt = (uint64_t)chunk << 9, max_discard;
+
+	if (s->g.idx.layout == DESTRIPE_LAYOUT_INTERLEAVED)
+		io_opt *= s->g.idx.nr;
+	/* whole chunks per request, as destripe_io_hints() */
+	if (max_sectors >= chunk)
+		max_sectors -= max_sectors % chunk;
+
+	memset(&p, 0, sizeof(p));
+	p.len = sizeof(p);
+	p.types = UBLK_PARAM_TYPE_BASIC | UBLK_PARAM_TYPE_DISCARD;
+	p.basic.attrs = UBLK_ATTR_VOLATILE_CACHE | UBLK_ATTR_FUA;
+	p.basic.logical_bs_shift = 9;
+	p.basic.physical_bs_shift = 12;
+	p.basic.io_min_shift = (chunk & (chunk - 1)) ? 9 : 9 + __builtin_ctz(chunk);
+	p.basic.io_opt_shift = (io_opt & (io_opt - 1)) ? p.basic.io_min_shift :
+						       __builtin_ctzll(io_opt);
+	p.basic.max_sectors = max_sectors;
+	/* no request across a chunk boundary (a power of 2 only, for the block layer) */
+	if (!(chunk & (chunk - 1)))
+		p.basic.chunk_sectors = chunk;
+	p.basic.dev_sectors = s->target_len;
+
+	/* no data to buffer: as large as the target, in whole chunks */
+	max_discard = s->target_len < UINT32_MAX ? s->target_len : UINT32_MAX;
+	max_discard -= max_discard % chunk;
+	p.discard.discard_granularity = chunk << 9;
+	p.discard.max_discard_sectors = max_discard;
+	p.discard.max_write_zeroes_sectors = max_discard;
+	p.discard.max_discard_segments = 1;
+
+	return srv_ctrl(s, UBLK_CMD_SET_PARAMS, &p, sizeof(p), 0);
+}
+
+/* The striped devices, checked as destripe_get_dev() */
+static int srv_open_devs(struct srv *s, char **argv, uint64_t *source_len)
+{
+	unsigned long long start;
+	struct srv_dev *d;
+	struct stat st;
+	uint64_t bytes;
+	unsigned i;
+	char dummy;
+
+	*source_len = 0;
+	for (i = 0; i < s->nr_devs; i++) {
+		d = &s->dev[i];
+		d->path = argv[2 * i];
+		if (sscanf(argv[2 * i + 1], "%llu%c", &start, &dummy) != 1) {
+			fprintf(stderr, "Couldn't parse destripe destination device offset %s\n",
+				argv[2 * i + 1]);
+			return -1;
+		}
+		d->fd = open(d->path, O_RDWR | O_DIRECT);
+		if (d->fd < 0 && errno == EINVAL)
+			d->fd = open(d->path, O_RDWR);
+		if (d->fd < 0 || fstat(d->fd, &st)) {
+			fprintf(stderr, "%s: %s\n", d->path, strerror(errno));
+			return -1;
+		}
+		d->bdev = !S_ISREG(st.st_mode);
+		if (!d->bdev)
+			bytes = st.st_size;
+		else if (ioctl(d->fd, BLKGETSIZE64, &bytes)) {
+			fprintf(stderr, "%s: %s\n", d->path, strerror(errno));
+			return -1;
+		}
+		if (start >= bytes >> 9) {
+			fprintf(stderr, "%s: Destination device offset beyond the device size\n",
+				d->path);
+			return -1;
+		}
+		d->physical_start = start;
+		d->source_start = *source_len;
+		d->source_secs = (bytes >> 9) - start;
+		if (i < s->nr_devs - 1 && d->source_secs % s->g.chunk_size) {
+			fprintf(stderr, "%s: Destination device size (from offset) not a multiple"
+				" of chunk size\n", d->path);
+			return -1;
+		}
+		*source_len += d->source_secs;
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-q <queues>] [-d <depth>] [-n <ublk id>] [-l <length (sectors)>]\n"
+			"       <stripes> <destripe idx> <chunk size (sectors)> <#devs> <dev path> <offset>"
+			" [<dev path> <offset>...]\n"
+			"       [<#features> <feature>...]\n"
+			"  Serves a destripe target, with the destripe table arguments, as /dev/ublkb<id>\n"
+			"  until SIGINT/SIGTERM. The length defaults to the largest the devices hold.\n"
+			"  %u queue(s) of %u requests by default.\n",
+			prog, 1, SRV_DEPTH);
+}
+
+int main(int argc, char **argv)
+{
+	struct srv *s;
+	struct destripe_idx_set set;
+	uint64_t source_len, member_len;
+	unsigned long long len = 0;
+	unsigned nr_features, i, f, chunk, destripes;
+	const char *err;
+	char path[64];
+	sigset_t sigs;
+	const char *prog = argv[0];
+	int opt, sig, r, dev_id = -1;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		fprintf(stderr, "Out of memory\n");
+		return 2;
+	}
+	s->nr_queues = 1;
+	s->depth = SRV_DEPTH;
+	while ((opt = getopt(argc, argv, "q:d:n:l:h")) != -1) {
+		switch (opt) {
+		case 'q':
+			s->nr_queues = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			s->depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			dev_id = strtol(optarg, NULL, 10);
+			break;
+		case 'l':
+			len = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (!s->nr_queues || s->nr_queues > SRV_MAX_QUEUES || !s->depth ||
+	    s->depth > UBLK_MAX_QUEUE_DEPTH) {
+		fprintf(stderr, "Invalid queues (1-%u) or depth (1-%u)\n", SRV_MAX_QUEUES,
+			UBLK_MAX_QUEUE_DEPTH);
+		return 2;
+	}
+
+	/* the table: <stripes> <idx> <chunk> <#devs> <dev> <offset>... [<#features> ...] */
+	argc -= optind;
+	argv += optind;
+	if (argc < 6) {
+		usage(prog);
+		return 2;
+	}
+	destripes = strtoul(argv[0], NULL, 10);
+	chunk = strtoul(argv[2], NULL, 10);
+	s->nr_devs = strtoul(argv[3], NULL, 10);
+	if (!s->nr_devs || s->nr_devs > SRV_MAX_DEVS || (unsigned)argc < 4 + 2 * s->nr_devs) {
+		fprintf(stderr, "Invalid number of destination devices\n");
+		return 2;
+	}
+	if (argc > 4 + 2 * (int)s->nr_devs) {
+		nr_features = strtoul(argv[4 + 2 * s->nr_devs], NULL, 10);
+		if (nr_features != argc - 5 - 2 * s->nr_devs) {
+			fprintf(stderr, "Invalid number of feature args\n");
+			return 2;
+		}
+		for (i = 5 + 2 * s->nr_devs; i < (unsigned)argc; i++) {
+			for (f = 0; f < sizeof(srv_feature_names) / sizeof(srv_feature_names[0]); f++)
+				if (!strcasecmp(argv[i], srv_feature_names[f]))
+					break;
+			if (f == sizeof(srv_feature_names) / sizeof(srv_feature_names[0])) {
+				fprintf(stderr, "Unrecognised destripe feature requested\n");
+				return 2;
+			}
+			if (f) {
+				fprintf(stderr, "Feature %s is only implemented by the kernel target\n",
+					argv[i]);
+				return 2;
+			}
+		}
+	}
+
+	/* checks & mapping of destripe_ctr(); the length is that of the dm table */
+	if ((err = destripe_geom_check(destripes, 0, chunk)) ||
+	    (err = destripe_idx_parse(argv[1], destripes, &set))) {
+		fprintf(stderr, "%s\n", err);
+		return 2;
+	}
+	s->g.chunk_size = chunk;
+	if (srv_open_devs(s, argv + 4, &source_len))
+		return 1;
+	if (!len)
+		len = source_len / destripes / chunk * chunk * set.nr;
+	if (destripe_geom_setup_spec(&s->g, destripes, argv[1], chunk, len, &err)) {
+		fprintf(stderr, "%s\n", err);
+		return 2;
+	}
+	member_len = len / set.nr;
+	if (!len || source_len < member_len * destripes) {
+		fprintf(stderr, "Physical device capacity not enough to support destripes on"
+			" requested target length\n");
+		return 2;
+	}
+	for (i = 1; i < s->nr_devs; i++)
+		if (s->dev[i].source_start >= member_len * destripes) {
+			fprintf(stderr, "More destination devices than needed for the target length\n");
+			return 2;
+		}
+	s->target_len = len;
+
+	/* the ublk device */
+	s->ctrl_fd = open(SRV_CTRL_DEV, O_RDWR);
+	if (s->ctrl_fd < 0) {
+		fprintf(stderr, "%s: %s (modprobe ublk_drv)\n", SRV_CTRL_DEV, strerror(errno));
+		return 1;
+	}
+	r = destripe_ring_init(&s->ctrl, 4, IORING_SETUP_SQE128);
+	if (r) {
+		fprintf(stderr, "io_uring: %s\n", strerror(-r));
+		return 1;
+	}
+	s->info.nr_hw_queues = s->nr_queues;
+	s->info.queue_depth = s->depth;
+	s->info.max_io_buf_bytes = SRV_BUF_BYTES;
+	s->info.dev_id = dev_id;
+	r = srv_ctrl(s, UBLK_CMD_ADD_DEV, &s->info, sizeof(s->info), 0);
+	if (r) {
+		fprintf(stderr, "Adding the ublk device failed: %s\n", strerror(-r));
+		return 1;
+	}
+
+	r = srv_set_params(s);
+	if (r) {
+		fprintf(stderr, "Setting the ublk device parameters failed: %s\n", strerror(-r));
+		goto out_del;
+	}
+
+	/* created by udev */
+	snprintf(path, sizeof(path), SRV_CDEV, s->info.dev_id);
+	for (i = 0; i < SRV_CDEV_WAIT; i++) {
+		s->cdev_fd = open(path, O_RDWR);
+		if (s->cdev_fd >= 0 || errno != ENOENT)
+			break;
+		usleep(10000);
+	}
+	if (s->cdev_fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		r = -errno;
+		goto out_del;
+	}
+
+	/* the signals are for the main thread only, sigwait()ed below */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	s->stop_fd = eventfd(0, 0);
+	if (s->stop_fd < 0) {
+		fprintf(stderr, "eventfd: %s\n", strerror(errno));
+		r = -errno;
+		goto out_del;
+	}
+	pthread_barrier_init(&s->started, NULL, s->nr_queues + 1);
+	for (i = 0; i < s->nr_queues; i++) {
+		s->queue[i].s = s;
+		s->queue[i].q_id = i;
+		if (pthread_create(&s->queue[i].thread, NULL, srv_queue_run, &s->queue[i])) {
+			fprintf(stderr, "Starting the queue threads failed\n");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&s->started);
+
+	if (!s->failed) {
+		r = srv_ctrl(s, UBLK_CMD_START_DEV, NULL, 0, getpid());
+		if (r)
+			fprintf(stderr, "Starting the ublk device failed: %s\n", strerror(-r));
+	}
+	if (!s->failed && !r) {
+		printf("/dev/ublkb%u: destripe %u %s %u, %llu sectors, %u queue(s) of %u\n",
+			s->info.dev_id, destripes, argv[1], chunk, len, s->nr_queues, s->depth);
+		fflush(stdout);
+		sigwait(&sigs, &sig);
+	}
+
+	/* no more requests, then the queue threads go & release the cdev */
+	srv_ctrl(s, UBLK_CMD_STOP_DEV, NULL, 0, 0);
+	if (eventfd_write(s->stop_fd, 1))
+		fprintf(stderr, "Stopping the queue threads failed: %s\n", strerror(errno));
+	for (i = 0; i < s->nr_queues; i++) {
+		pthread_join(s->queue[i].thread, NULL);
+		if (s->queue[i].err) {
+			fprintf(stderr, "Queue %u: %s\n", i, strerror(-s->queue[i].err));
+			r = s->queue[i].err;
+		}
+	}
+	close(s->cdev_fd);
+out_del:
+	srv_ctrl(s, UBLK_CMD_DEL_DEV, NULL, 0, 0);
+	return r ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) userspace library.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+
+#include "libdestripe.h"
+
+int destripe_geom_setup(struct destripe_geom *g, uint32_t destripes,
+			uint32_t destripe_idx, uint32_t chunk_size, const char **err)
+{
+	const char *geom_err;
+
+	if ((geom_err = destripe_geom_check(destripes, destripe_idx, chunk_size))) {
+		if (err)
+			*err = geom_err;
+		return -EINVAL;
+	}
+
+	destripe_geom_init(g, destripes, destripe_idx, chunk_size);
+	return 0;
+}
+
+int destripe_geom_setup_spec(struct destripe_geom *g, uint32_t destripes, const char *spec,
+			uint32_t chunk_size, uint64_t target_len, const char **err)
+{
+	struct destripe_idx_set set;
+	const char *geom_err;
+
+	if (!(geom_err = destripe_geom_check(destripes, 0, chunk_size)) &&
+	    !(geom_err = destripe_idx_parse(spec, destripes, &set)) &&
+	    !(geom_err = destripe_geom_check_len(&set, chunk_size, target_len))) {
+		destripe_geom_init_set(g, destripes, &set, chunk_size, target_len / set.nr);
+		return 0;
+	}
+
+	if (err)
+		*err = geom_err;
+	return -EINVAL;
+}
+
+sector_t destripe_map_sector(const struct destripe_geom *g, sector_t offset)
+{
+	return destripe_geom_map(g, offset);
+}
+
+sector_t destripe_unmap_sector(const struct destripe_geom *g, sector_t phys, uint32_t *idx)
+{
+	return destripe_geom_unmap(g, phys, idx);
+}
+
+sector_t destripe_unmap_target_sector(const struct destripe_geom *g, sector_t phys)
+{
+	return destripe_geom_unmap_target(g, phys);
+}
+
+/*-----------------------------------------------------------------
+ * Batch translation kernels.
+ *
+ * The geometry class is checked once per call and each class gets its
+ * own loop with only the arithmetic it needs, so that the power of 2
+ * cases compile to branch-free shift/mask loops the compiler vectorizes.
+ *---------------------------------------------------------------*/
+
+void destripe_map_sectors(const struct destripe_geom *g, const sector_t *in,
+			sector_t *out, size_t nr)
+{
+	size_t i;
+
+	switch (g->map_class) {
+	case DESTRIPE_MAP_SHIFT:
+		for (i = 0; i < nr; i++)
+			out[i] = destripe_map_shift(g, in[i]);
+		break;
+	case DESTRIPE_MAP_CHUNK_SHIFT:
+		for (i = 0; i < nr; i++)
+			out[i] = destripe_map_chunk_shift(g, in[i]);
+		break;
+	case DESTRIPE_MAP_MULTI:
+		for (i = 0; i < nr; i++)
+			out[i] = destripe_map_multi(g, in[i]);
+		break;
+	default:
+		for (i = 0; i < nr; i++)
+			out[i] = destripe_map_generic(g, in[i]);
+		break;
+	}
+}
+
+void destripe_unmap_sectors(const struct destripe_geom *g, const sector_t *phys,
+			uint32_t *idx, sector_t *out, size_t nr)
+{
+	const int cs = g->chunk_size_shift, rs = g->row_shift;
+	const sector_t mask = g->chunk_mask, idx_mask = (sector_t)g->destripes - 1;
+	uint32_t dummy;
+	size_t i;
+
+	if (g->map_class == DESTRIPE_MAP_SHIFT) {
+		if (idx)
+			for (i = 0; i < nr; i++)
+				idx[i] = (uint32_t)((phys[i] >> cs) & idx_mask);
+		for (i = 0; i < nr; i++)
+			out[i] = ((phys[i] >> rs) << cs) | (phys[i] & mask);
+	} else {
+		for (i = 0; i < nr; i++)
+			out[i] = destripe_geom_unmap(g, phys[i], idx ? &idx[i] : &dummy);
+	}
+}
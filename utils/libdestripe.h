@@ -0,0 +1,73 @@
+/**
+ * Device mapper destripe (i.e. reverse striping) userspace library.
+ *
+ * Copyright (C) 2013 OnApp Ltd.
+ *
+ * Author: Michail Flouris <michail.flouris@onapp.com>
+ *
+ * This file is part of the device mapper destriping driver/module.
+ *
+ * The dm-destripe driver is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * Some open source application is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBDESTRIPE_H
+#define _LIBDESTRIPE_H
+
+/* Same address translation code as the kernel module */
+#include <stddef.h>
+
+#include "dm-destripe-map.h"
+
+/*
+ * Set up a destripe geometry with the same checks as the destripe_ctr()
+ * table arguments. Returns 0 or -EINVAL, with *err pointing to the reason.
+ */
+int destripe_geom_setup(struct destripe_geom *g, uint32_t destripes,
+			uint32_t destripe_idx, uint32_t chunk_size, const char **err);
+
+/*
+ * Same as destripe_geom_setup(), for an index spec as in the table ("2",
+ * "0,2" interleaved or "0+1+2" concatenated) and a target of target_len sectors.
+ */
+int destripe_geom_setup_spec(struct destripe_geom *g, uint32_t destripes, const char *spec,
+			uint32_t chunk_size, uint64_t target_len, const char **err);
+
+/* Map a sector of the destriped device to its sector on the striped source */
+sector_t destripe_map_sector(const struct destripe_geom *g, sector_t offset);
+
+/*
+ * Inverse mapping: sector on the striped source to the stripe index owning
+ * it (*idx) and the sector within that stripe's destriped device.
+ */
+sector_t destripe_unmap_sector(const struct destripe_geom *g, sector_t phys, uint32_t *idx);
+
+/*
+ * Inverse mapping to the device of g (any index spec): sector on the striped
+ * source to the sector of the destriped device, or (sector_t)-1 if the source
+ * sector belongs to a stripe index the device does not expose.
+ */
+sector_t destripe_unmap_target_sector(const struct destripe_geom *g, sector_t phys);
+
+/*
+ * Batch versions of the above, translating nr sectors in one call. The loops
+ * are specialized per geometry so that the compiler can vectorize them; use
+ * these for bulk work like blktrace attribution instead of per sector calls.
+ * The in & out arrays may be the same (in place translation), idx may be NULL.
+ */
+void destripe_map_sectors(const struct destripe_geom *g, const sector_t *in,
+			sector_t *out, size_t nr);
+void destripe_unmap_sectors(const struct destripe_geom *g, const sector_t *phys,
+			uint32_t *idx, sector_t *out, size_t nr);
+
+#endif /* _LIBDESTRIPE_H */